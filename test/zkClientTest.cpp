@@ -3,6 +3,10 @@
 
 #include <memory>
 #include <iostream>
+#include <mutex>
+#include <condition_variable>
+
+#include <zookeeper/zookeeper.h>
 
 #include "zkClient.h"
 
@@ -12,10 +16,98 @@ using namespace Clotho;
 TEST(zkClientTest, ClientInitTest) {
 
     auto client = std::make_shared<zkClient>("127.0.0.1:2181,127.0.0.1:2182,127.0.0.1:2183");
-    bool client_ok = client;
+    bool client_ok = static_cast<bool>(client);
     ASSERT_THAT(client_ok, Eq(true));
 
     ASSERT_THAT(client->zk_init(), Eq(true));
+    ASSERT_THAT(client->connected(), Eq(true));
 
     ::sleep(1);
 }
+
+TEST(zkClientTest, ClientInitTimeoutTest) {
+
+    // 没有服务监听的端口，zk_init应当在会话超时之后返回失败，而不是一直阻塞
+    auto client = std::make_shared<zkClient>("127.0.0.1:1", BizEventFunc(), "default", 1000);
+    ASSERT_THAT(client->zk_init(), Eq(false));
+    ASSERT_THAT(client->connected(), Eq(false));
+    ASSERT_THAT(client->conn_state(), Eq(ConnState::kConnecting));
+}
+
+TEST(zkClientTest, ClientAsyncTest) {
+
+    auto client = std::make_shared<zkClient>("127.0.0.1:2181,127.0.0.1:2182,127.0.0.1:2183");
+    ASSERT_THAT(client->zk_init(), Eq(true));
+
+    const char* path = "/clotho_async_test";
+    client->zk_delete(path);
+
+    std::mutex lock;
+    std::condition_variable cond;
+    int pending = 0;
+    std::vector<int> codes;
+
+    auto done = [&](int rc) {
+        std::lock_guard<std::mutex> guard(lock);
+        codes.push_back(rc);
+        --pending;
+        cond.notify_all();
+    };
+
+    // 多个请求同时在途，ZooKeeper保证同一个会话中的请求按照顺序完成
+    pending = 3;
+    ASSERT_THAT(client->zk_acreate(path, "v1", NULL, 0,
+                                   [&](int rc, const std::string& created) { done(rc); }), Eq(0));
+    ASSERT_THAT(client->zk_aset(path, "v2", -1,
+                                [&](int rc, const struct Stat* stat) { done(rc); }), Eq(0));
+    std::string value;
+    ASSERT_THAT(client->zk_aget(path, 0,
+                                [&](int rc, const std::string& val, const struct Stat* stat) {
+                                    value = val;
+                                    done(rc);
+                                }), Eq(0));
+
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [&] { return pending == 0; });
+    }
+
+    ASSERT_THAT(codes, ElementsAre(ZOK, ZOK, ZOK));
+    ASSERT_THAT(value, Eq("v2"));
+
+    pending = 1;
+    ASSERT_THAT(client->zk_adelete(path, -1, done), Eq(0));
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [&] { return pending == 0; });
+    }
+
+    ASSERT_THAT(client->zk_exists(path, 0, NULL), Eq(0));
+}
+
+TEST(zkClientTest, ClientGetLargeTest) {
+
+    auto client = std::make_shared<zkClient>("127.0.0.1:2181,127.0.0.1:2182,127.0.0.1:2183");
+    ASSERT_THAT(client->zk_init(), Eq(true));
+
+    const char* path = "/clotho_large_test";
+    client->zk_delete(path);
+
+    // 超过默认缓冲区长度，并且包含'\0'的二进制内容
+    std::string blob(200 * 1024, 'x');
+    for (size_t i = 0; i < blob.size(); i += 1000)
+        blob[i] = '\0';
+
+    ASSERT_THAT(client->zk_create(path, blob, NULL, 0), Eq(0));
+
+    std::string value;
+    ASSERT_THAT(client->zk_get(path, value, 0, NULL), Eq(0));
+    ASSERT_THAT(value.size(), Eq(blob.size()));
+    ASSERT_THAT(value == blob, Eq(true));
+
+    ASSERT_THAT(client->zk_set(path, ""), Eq(0));
+    ASSERT_THAT(client->zk_get(path, value, 0, NULL), Eq(0));
+    ASSERT_THAT(value.empty(), Eq(true));
+
+    ASSERT_THAT(client->zk_delete(path), Eq(0));
+}
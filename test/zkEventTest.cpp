@@ -0,0 +1,99 @@
+#include <gmock/gmock.h>
+#include <string>
+#include <map>
+#include <vector>
+
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+#include "zkEvent.h"
+
+using namespace ::testing;
+
+namespace Clotho {
+
+TEST(zkEventTest, ServiceKeyTest) {
+
+    ASSERT_THAT(zkEventQueue::service_key("/dept"), Eq("/dept"));
+    ASSERT_THAT(zkEventQueue::service_key("/dept/srv"), Eq("/dept/srv"));
+    ASSERT_THAT(zkEventQueue::service_key("/dept/srv/10.0.0.1:100"), Eq("/dept/srv"));
+    ASSERT_THAT(zkEventQueue::service_key("/dept/srv/10.0.0.1:100/weight"), Eq("/dept/srv"));
+}
+
+TEST(zkEventTest, EventOrderTest) {
+
+    std::mutex lock;
+    std::map<std::string, std::vector<int>> received;
+
+    auto handler = [&](int type, int state, const char* path) -> int {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        std::lock_guard<std::mutex> guard(lock);
+        received[zkEventQueue::service_key(path)].push_back(type);
+        return 0;
+    };
+
+    zkEventQueue events(4, handler);
+    ASSERT_THAT(events.start(), Eq(true));
+
+    const int kCount = 100;
+    for (int i = 0; i < kCount; ++i) {
+        events.push(i, 0, "/dept/srv_a/10.0.0.1:100");
+        events.push(i, 0, "/dept/srv_b");
+        events.push(i, 0, "/dept/srv_c/10.0.0.2:100/weight");
+    }
+
+    ASSERT_THAT(events.depth(), Gt(0u));
+    while (events.depth() != 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    events.stop();
+
+    // 每个服务内部的事件保持入队的顺序
+    ASSERT_THAT(received.size(), Eq(3u));
+    for (auto iter = received.begin(); iter != received.end(); ++iter) {
+        ASSERT_THAT(iter->second.size(), Eq(static_cast<size_t>(kCount)));
+        for (int i = 0; i < kCount; ++i)
+            ASSERT_THAT(iter->second[i], Eq(i));
+    }
+}
+
+TEST(zkEventTest, EventCoalesceTest) {
+
+    std::mutex lock;
+    std::vector<std::string> received;
+
+    auto handler = [&](int type, int state, const char* path) -> int {
+        std::lock_guard<std::mutex> guard(lock);
+        received.push_back(path);
+        return 0;
+    };
+
+    // 窗口内同一路径同一类型的事件只处理一次
+    zkEventQueue events(1, handler, 200);
+    ASSERT_THAT(events.start(), Eq(true));
+
+    for (int i = 0; i < 100; ++i) {
+        events.push(4, 0, "/dept/srv_a");
+        events.push(4, 0, "/dept/srv_a/10.0.0.1:100");
+    }
+    events.push(3, 0, "/dept/srv_a");
+
+    ASSERT_THAT(events.depth(), Eq(3u));
+    ASSERT_THAT(events.coalesced(), Eq(198u));
+
+    while (events.depth() != 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    // 处理之后的事件重新入队
+    events.push(4, 0, "/dept/srv_a");
+    while (events.depth() != 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    events.stop();
+
+    std::lock_guard<std::mutex> guard(lock);
+    ASSERT_THAT(received, ElementsAre("/dept/srv_a", "/dept/srv_a/10.0.0.1:100", "/dept/srv_a", "/dept/srv_a"));
+}
+
+}  // end Clotho
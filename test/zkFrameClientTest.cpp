@@ -58,3 +58,110 @@ TEST_F(FrameClientTest, ClientPickNodeTest) {
 }
 
 
+
+TEST_F(FrameClientTest, ClientSubscribeTest) {
+
+    ASSERT_THAT(client_->subscribe_service("dept", "srv_inst", kStrategyDefault, true), Eq(0));
+
+    // 全部节点和节点属性都应该获取到
+    std::vector<NodeType> nodes;
+    ASSERT_THAT(client_->pick_service_nodes("dept", "srv_inst", kStrategyRandom, 100, nodes), Eq(0));
+    ASSERT_THAT(nodes.size(), Ge(3u));
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        ASSERT_THAT(nodes[i].active_, Eq(true));
+        ASSERT_THAT(nodes[i].properties_["ppa"], Eq("ppa_val"));
+    }
+
+    ASSERT_THAT(client_->revoke_all_nodes(), Eq(0));
+    ::sleep(1);
+}
+
+TEST_F(FrameClientTest, ClientPickHandleTest) {
+
+    ServiceHandle handle;
+    ASSERT_THAT(client_->subscribe_service("dept", "srv_inst", kStrategyDefault, true, handle), Eq(0));
+    ASSERT_THAT(handle.get(), NotNull());
+
+    NodeType node_g{};
+    ASSERT_THAT(client_->pick(handle, node_g), Eq(0));
+    ASSERT_THAT(node_g.service_, Eq("srv_inst"));
+
+    ASSERT_THAT(client_->pick(handle, kStrategyRoundRobin, node_g), Eq(0));
+    ASSERT_THAT(client_->pick(handle, std::string("user_key"), node_g), Eq(0));
+
+    ASSERT_THAT(client_->pick(ServiceHandle(), node_g), Eq(-1));
+
+    Endpoint endpoint;
+    ASSERT_THAT(client_->pick(handle, endpoint), Eq(0));
+    ASSERT_THAT(endpoint.port_, Ge(1222));
+    ASSERT_THAT(endpoint.node_.get(), NotNull());
+    ASSERT_THAT(endpoint.node_->service_, Eq("srv_inst"));
+
+    ASSERT_THAT(client_->revoke_all_nodes(), Eq(0));
+    ::sleep(1);
+}
+
+TEST_F(FrameClientTest, ClientMembershipTest) {
+
+    ASSERT_THAT(client_->subscribe_service("dept", "srv_inst", kStrategyDefault, true), Eq(0));
+
+    std::vector<NodeType> nodes;
+    ASSERT_THAT(client_->pick_service_nodes("dept", "srv_inst", kStrategyRandom, 100, nodes), Eq(0));
+    size_t count = nodes.size();
+
+    // 新增节点只获取该节点的信息
+    NodeType node("dept", "srv_inst", "127.0.0.1:1225", { { "ppa", "ppa_new" } });
+    ASSERT_THAT(client_->register_node(node, true), Eq(0));
+    ::sleep(1);
+
+    ASSERT_THAT(client_->pick_service_nodes("dept", "srv_inst", kStrategyRandom, 100, nodes), Eq(0));
+    ASSERT_THAT(nodes.size(), Eq(count + 1));
+
+    std::set<std::string> exclude;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (nodes[i].node_ != "127.0.0.1:1225")
+            exclude.insert(nodes[i].node_);
+    }
+    ASSERT_THAT(client_->pick_service_nodes("dept", "srv_inst", kStrategyRandom, 1, nodes, exclude), Eq(0));
+    ASSERT_THAT(nodes[0].properties_["ppa"], Eq("ppa_new"));
+
+    ASSERT_THAT(client_->revoke_all_nodes(), Eq(0));
+    ::sleep(1);
+}
+
+TEST_F(FrameClientTest, ClientPeriodicCareTest) {
+
+    ServiceHandle handle;
+    ASSERT_THAT(client_->subscribe_service("dept", "srv_inst", kStrategyDefault, true, handle), Eq(0));
+
+    // 订阅的时候记录了服务目录和节点的版本信息
+    ServiceRoutePtr route = handle->route();
+    ASSERT_THAT(route.get(), NotNull());
+    ASSERT_THAT(route->service().versions_.count("/dept/srv_inst"), Eq(1u));
+    uint64_t version = route->service().version_;
+
+    // 没有变化的时候不会重新发布快照
+    ASSERT_THAT(client_->periodicly_care(), Eq(0));
+    ASSERT_THAT(handle->route()->service().version_, Eq(version));
+
+    ASSERT_THAT(client_->revoke_all_nodes(), Eq(0));
+    ::sleep(1);
+}
+
+TEST_F(FrameClientTest, ClientSubscribeServicesTest) {
+
+    std::vector<ServiceSubscription> subscriptions = {
+        ServiceSubscription("dept", "srv_inst", kStrategyRoundRobin, true),
+        ServiceSubscription("dept", "srv_inst_nonexist"),
+    };
+
+    // 不存在的服务订阅失败，不影响其他服务
+    ASSERT_THAT(client_->subscribe_services(subscriptions, 5 * 1000), Eq(-1));
+
+    NodeType node_g{};
+    ASSERT_THAT(client_->pick_service_node("dept", "srv_inst", node_g), Eq(0));
+    ASSERT_THAT(client_->pick_service_node("dept", "srv_inst_nonexist", node_g), Eq(-1));
+
+    ASSERT_THAT(client_->revoke_all_nodes(), Eq(0));
+    ::sleep(1);
+}
@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <iostream>
+#include <fstream>
 
 #include "zkFrame.h"
 
@@ -90,3 +91,68 @@ TEST_F(FrameTest, ClientRegisterTest) {
 }
 
 
+
+TEST_F(FrameTest, ClientRegisterOverwriteTest) {
+
+    NodeType node("dept", "srv_overwrite", "127.0.0.1:1300", { { "ppa", "v1" } });
+    ASSERT_THAT(client_->register_node(node, false), 0);
+
+    // 节点的active由当前会话持有，重复注册成功，并且覆盖属性
+    node.properties_["ppa"] = "v2";
+    ASSERT_THAT(client_->register_node(node, true), 0);
+
+    ASSERT_THAT(client_->subscribe_service("dept", "srv_overwrite", 0, true), Eq(0));
+
+    NodeType node2 {};
+    ASSERT_THAT(client_->pick_service_node("dept", "srv_overwrite", node2), Eq(0));
+    ASSERT_THAT(node2.properties_["ppa"], Eq("v2"));
+
+    ASSERT_THAT(client_->revoke_all_nodes(), Eq(0));
+    ::sleep(1);
+}
+
+TEST_F(FrameTest, ClientRegisterPackedTest) {
+
+    NodeType node("dept", "srv_packed", "127.0.0.1:1400", { { "ppa", "ppa_val" }, { "weight", "20" } });
+    ASSERT_THAT(client_->register_node(node, true, true), 0);
+
+    ASSERT_THAT(client_->subscribe_service("dept", "srv_packed", 0, true), Eq(0));
+
+    NodeType node2 {};
+    ASSERT_THAT(client_->pick_service_node("dept", "srv_packed", node2), Eq(0));
+    ASSERT_THAT(node2.enabled_, Eq(true));
+    ASSERT_THAT(node2.weight_, Eq(20));
+    ASSERT_THAT(node2.properties_["ppa"], Eq("ppa_val"));
+
+    ASSERT_THAT(client_->revoke_all_nodes(), Eq(0));
+    ::sleep(1);
+}
+
+TEST(zkFrameTest, LoadManifestTest) {
+
+    const char* file = "/tmp/clotho_manifest_test.conf";
+    {
+        std::ofstream ofs(file);
+        ofs << "# upstream services" << std::endl
+            << std::endl
+            << "dept srv_a" << std::endl
+            << "dept srv_b 0x100 0" << std::endl;
+    }
+
+    std::vector<ServiceSubscription> subscriptions;
+    ASSERT_THAT(zkFrame::load_manifest(file, subscriptions), Eq(0));
+    ASSERT_THAT(subscriptions.size(), Eq(2u));
+    ASSERT_THAT(subscriptions[0].service_, Eq("srv_a"));
+    ASSERT_THAT(subscriptions[0].strategy_, Eq(kStrategyDefault));
+    ASSERT_THAT(subscriptions[0].with_nodes_, Eq(true));
+    ASSERT_THAT(subscriptions[1].strategy_, Eq(kStrategySWRR));
+    ASSERT_THAT(subscriptions[1].with_nodes_, Eq(false));
+
+    {
+        std::ofstream ofs(file);
+        ofs << "dept" << std::endl;
+    }
+    ASSERT_THAT(zkFrame::load_manifest(file, subscriptions), Eq(-1));
+
+    ::remove(file);
+}
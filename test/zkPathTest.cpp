@@ -48,4 +48,27 @@ TEST(zkPathTest, PathTypeTest) {
 
 }
 
+TEST(zkPathTest, PackedPropertiesTest) {
+
+    std::map<std::string, std::string> properties = {
+        { "enable", "1" },
+        { "idc", "aliyun" },
+        { "cfg_a=b", "x\\y\nz=" },
+        { "cfg_empty", "" },
+    };
+
+    std::string value = zkPath::pack_properties(properties);
+    ASSERT_THAT(zkPath::is_packed(value), Eq(true));
+    ASSERT_THAT(zkPath::is_packed("1"), Eq(false));
+
+    std::map<std::string, std::string> result;
+    ASSERT_THAT(zkPath::unpack_properties(value, result), Eq(true));
+    ASSERT_THAT(result, Eq(properties));
+
+    // 非打包格式以及损坏的内容
+    ASSERT_THAT(zkPath::unpack_properties("1", result), Eq(false));
+    ASSERT_THAT(zkPath::unpack_properties("#clotho:1\nnosep\n", result), Eq(false));
+    ASSERT_THAT(zkPath::unpack_properties("#clotho:1\nkey=val", result), Eq(false));
+}
+
 }  // end Clotho
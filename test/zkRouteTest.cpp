@@ -0,0 +1,367 @@
+#include <gmock/gmock.h>
+#include <string>
+#include <set>
+
+#include <iostream>
+
+#include "zkFrame.h"
+#include "zkRoute.h"
+
+using namespace ::testing;
+
+namespace Clotho {
+
+static NodeType make_node(const std::string& node, const std::string& idc,
+                          uint16_t priority, uint16_t weight) {
+
+    NodeType n("dept", "srv_inst", node);
+    zkPath::validate_node(node, n.host_, n.port_);
+    n.active_   = true;
+    n.enabled_  = true;
+    n.idc_      = idc;
+    n.priority_ = priority;
+    n.weight_   = weight;
+    return n;
+}
+
+TEST(zkRouteTest, RouteIndexTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    srv.nodes_["10.0.0.1:100"] = make_node("10.0.0.1:100", "aliyun", 50, 50);
+    srv.nodes_["10.0.0.2:100"] = make_node("10.0.0.2:100", "aliyun", 60, 50);
+    srv.nodes_["10.0.0.3:100"] = make_node("10.0.0.3:100", "tencent", 60, 50);
+    srv.nodes_["10.0.0.4:100"] = make_node("10.0.0.4:100", "tencent", 60, 50);
+    srv.nodes_["10.0.0.4:100"].active_ = false;
+
+    ServiceRoute route(srv, "aliyun");
+    ASSERT_THAT(route.size(), Eq(3));
+
+    // 只有priority_最高的梯队参与权重选择
+    for (size_t i = 0; i < 100; ++i) {
+        int index = route.pick(kStrategyWP);
+        ASSERT_THAT(index, Ge(0));
+        ASSERT_THAT(route.node(index).priority_, Eq(60));
+    }
+
+    // 本地IDC的桶内只有一个最高优先级节点
+    for (size_t i = 0; i < 100; ++i) {
+        int index = route.pick(kStrategyIdc | kStrategyWP);
+        ASSERT_THAT(route.node(index).node_, Eq("10.0.0.2:100"));
+    }
+
+    // 没有lock_master属性
+    ASSERT_THAT(route.pick(kStrategyMaster), Eq(-1));
+}
+
+TEST(zkRouteTest, AliasTableTest) {
+
+    std::vector<uint32_t> weights = { 10, 20, 30, 40 };
+    AliasTable alias;
+    alias.build(weights);
+
+    // 遍历所有的(槽位, 阈值)组合，取每个区间中点对应的随机数，
+    // 每个元素被选中的次数严格和权重成比例
+    std::vector<uint32_t> hits(weights.size(), 0);
+    for (uint64_t slot = 0; slot < weights.size(); ++slot) {
+        uint32_t r1 = static_cast<uint32_t>(((2 * slot + 1) << 32) / (2 * weights.size()));
+        for (uint64_t threshold = 0; threshold < 100; ++threshold) {
+            uint32_t r2 = static_cast<uint32_t>(((2 * threshold + 1) << 32) / (2 * 100));
+            hits[alias.pick(r1, r2)] ++;
+        }
+    }
+
+    for (size_t i = 0; i < weights.size(); ++i)
+        ASSERT_THAT(hits[i], Eq(weights[i] * weights.size()));
+
+    std::vector<uint32_t> zeros = { 0, 0 };
+    alias.build(zeros);
+    ASSERT_THAT(alias.pick(0, 0), Eq(0));
+    ASSERT_THAT(alias.pick(0xFFFFFFFF, 0xFFFFFFFF), Eq(1));
+}
+
+TEST(zkRouteTest, RouteRoundRobinTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    srv.nodes_["10.0.0.1:100"] = make_node("10.0.0.1:100", "aliyun", 50, 50);
+    srv.nodes_["10.0.0.2:100"] = make_node("10.0.0.2:100", "aliyun", 50, 50);
+    srv.nodes_["10.0.0.3:100"] = make_node("10.0.0.3:100", "aliyun", 50, 50);
+
+    ServiceRoute route(srv, "aliyun");
+    ServiceRoute other(srv, "aliyun");
+
+    // 每个服务的游标独立，其他服务的选择不影响本服务的轮询顺序
+    std::set<int> picked;
+    for (size_t i = 0; i < 3; ++i) {
+        picked.insert(route.pick(kStrategyRoundRobin));
+        other.pick(kStrategyRoundRobin);
+    }
+    ASSERT_THAT(picked.size(), Eq(3));
+}
+
+TEST(zkRouteTest, RouteSWRRTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    srv.nodes_["10.0.0.1:100"] = make_node("10.0.0.1:100", "aliyun", 50, 5);
+    srv.nodes_["10.0.0.2:100"] = make_node("10.0.0.2:100", "aliyun", 50, 1);
+    srv.nodes_["10.0.0.3:100"] = make_node("10.0.0.3:100", "aliyun", 50, 1);
+
+    ServiceRoute route(srv, "aliyun");
+
+    // 权重5:1:1 的平滑序列为 a a b a c a a
+    std::string sequence;
+    for (size_t i = 0; i < 7; ++i) {
+        int index = route.pick(kStrategySWRR);
+        ASSERT_THAT(index, Ge(0));
+        sequence += route.node(index).node_.substr(7, 1);
+    }
+    ASSERT_THAT(sequence, Eq("1121311"));
+
+    // 重建路由索引之后继续原来的交错序列，而不是重新从权重最大的节点开始
+    for (size_t i = 0; i < 3; ++i)
+        route.pick(kStrategySWRR);
+
+    ServiceRoute rebuilt(srv, "aliyun", &route);
+    sequence.clear();
+    for (size_t i = 0; i < 4; ++i)
+        sequence += rebuilt.node(rebuilt.pick(kStrategySWRR)).node_.substr(7, 1);
+    ASSERT_THAT(sequence, Eq("1311"));
+}
+
+TEST(zkRouteTest, RouteConsistentHashTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    srv.pick_strategy_ = kStrategyConsistentHash;
+    for (int i = 1; i <= 10; ++i) {
+        std::string name = "10.0.0." + Clotho::to_string(i) + ":100";
+        srv.nodes_[name] = make_node(name, "aliyun", 50, 50);
+    }
+
+    ServiceRoute route(srv, "aliyun");
+
+    std::map<std::string, std::string> before;
+    for (int i = 0; i < 1000; ++i) {
+        std::string key = "key_" + Clotho::to_string(i);
+        int index = route.pick(kStrategyConsistentHash, key);
+        ASSERT_THAT(index, Ge(0));
+        ASSERT_THAT(route.pick(kStrategyConsistentHash, key), Eq(index));
+        before[key] = route.node(index).node_;
+    }
+
+    // 下线一个节点，只有原本落在该节点上的key会迁移
+    srv.nodes_["10.0.0.3:100"].active_ = false;
+    ServiceRoute incremental(srv, "aliyun", &route);
+    ServiceRoute full(srv, "aliyun");
+
+    for (auto iter = before.begin(); iter != before.end(); ++iter) {
+        std::string node = incremental.node(incremental.pick(kStrategyConsistentHash, iter->first)).node_;
+        ASSERT_THAT(full.node(full.pick(kStrategyConsistentHash, iter->first)).node_, Eq(node));
+        if (iter->second != "10.0.0.3:100")
+            ASSERT_THAT(node, Eq(iter->second));
+        else
+            ASSERT_THAT(node, Ne(iter->second));
+    }
+}
+
+TEST(zkRouteTest, RouteLazyRingTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    for (int i = 1; i <= 5; ++i) {
+        std::string name = "10.0.0." + Clotho::to_string(i) + ":100";
+        srv.nodes_[name] = make_node(name, "aliyun", 50, 50);
+    }
+
+    // 订阅时没有指定一致性哈希，第一次按照key选择的时候构造哈希环
+    ServiceRoute route(srv, "aliyun");
+    ServiceRoute hashed(srv, "aliyun");
+    for (int i = 0; i < 100; ++i) {
+        std::string key = "key_" + Clotho::to_string(i);
+        int index = route.pick(kStrategyConsistentHash, key);
+        ASSERT_THAT(index, Ge(0));
+        ASSERT_THAT(route.pick(kStrategyWP | kStrategyConsistentHash, key), Eq(index));
+        ASSERT_THAT(hashed.node(hashed.pick(kStrategyConsistentHash, key)).node_, Eq(route.node(index).node_));
+    }
+
+    // 重建之后沿用上一个版本的哈希环
+    ServiceRoute rebuilt(srv, "aliyun", &route);
+    for (int i = 0; i < 100; ++i) {
+        std::string key = "key_" + Clotho::to_string(i);
+        ASSERT_THAT(rebuilt.node(rebuilt.pick(kStrategyConsistentHash, key)).node_,
+                    Eq(route.node(route.pick(kStrategyConsistentHash, key)).node_));
+    }
+}
+
+TEST(zkRouteTest, RouteP2CTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    srv.nodes_["10.0.0.1:100"] = make_node("10.0.0.1:100", "aliyun", 50, 50);
+    srv.nodes_["10.0.0.2:100"] = make_node("10.0.0.2:100", "aliyun", 50, 50);
+    srv.nodes_["10.0.0.2:100"].properties_["max_inflight"] = "2";
+
+    ServiceRoute route(srv, "aliyun");
+
+    NodeLoad* slow = route.find_load("10.0.0.1:100");
+    NodeLoad* fast = route.find_load("10.0.0.2:100");
+    ASSERT_THAT(slow, NotNull());
+    ASSERT_THAT(fast, NotNull());
+
+    slow->report_call(10 * 1000, true);
+    fast->report_call(100, true);
+    for (size_t i = 0; i < 100; ++i)
+        ASSERT_THAT(route.node(route.pick(kStrategyP2C)).node_, Eq("10.0.0.2:100"));
+
+    // 达到并发上限之后跳过该节点
+    fast->begin_call();
+    fast->begin_call();
+    for (size_t i = 0; i < 100; ++i)
+        ASSERT_THAT(route.node(route.pick(kStrategyP2C)).node_, Eq("10.0.0.1:100"));
+
+    // 负载统计在路由索引重建之后保留
+    ServiceRoute rebuilt(srv, "aliyun", &route);
+    ASSERT_THAT(rebuilt.find_load("10.0.0.2:100"), Eq(fast));
+    ASSERT_THAT(fast->inflight(), Eq(2));
+}
+
+TEST(zkRouteTest, RouteLocalSaturatedTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    srv.nodes_["10.0.0.1:100"] = make_node("10.0.0.1:100", "aliyun", 50, 50);
+    srv.nodes_["10.0.0.1:100"].properties_["max_inflight"] = "1";
+    srv.nodes_["10.0.0.2:100"] = make_node("10.0.0.2:100", "tencent", 50, 50);
+
+    ServiceRoute route(srv, "aliyun");
+    ASSERT_THAT(route.node(route.pick(kStrategyDefault)).node_, Eq("10.0.0.1:100"));
+
+    // 本IDC唯一的节点达到并发上限，使用其他IDC的节点
+    route.find_load("10.0.0.1:100")->begin_call();
+    for (size_t i = 0; i < 100; ++i)
+        ASSERT_THAT(route.node(route.pick(kStrategyDefault)).node_, Eq("10.0.0.2:100"));
+}
+
+TEST(zkRouteTest, RouteSaturatedSkipTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    srv.nodes_["10.0.0.1:100"] = make_node("10.0.0.1:100", "aliyun", 50, 90);
+    srv.nodes_["10.0.0.1:100"].properties_["max_inflight"] = "1";
+    srv.nodes_["10.0.0.2:100"] = make_node("10.0.0.2:100", "aliyun", 50, 10);
+    srv.nodes_["10.0.0.2:100"].properties_["max_inflight"] = "1";
+    srv.nodes_["10.0.0.3:100"] = make_node("10.0.0.3:100", "tencent", 50, 50);
+    srv.nodes_["10.0.0.3:100"].properties_["max_inflight"] = "1";
+
+    ServiceRoute route(srv, "aliyun");
+    route.find_load("10.0.0.1:100")->begin_call();
+
+    // 每种策略都跳过达到并发上限的节点，仍然在本地IDC中选择
+    uint32_t strategies[] = { kStrategyWP, kStrategySWRR, kStrategyRandom, kStrategyRoundRobin, kStrategyP2C };
+    for (size_t s = 0; s < sizeof(strategies) / sizeof(strategies[0]); ++s) {
+        for (size_t i = 0; i < 20; ++i)
+            ASSERT_THAT(route.node(route.pick(kStrategyIdc | strategies[s])).node_, Eq("10.0.0.2:100"));
+    }
+
+    // 本地IDC全部饱和之后使用其他IDC的节点，全部饱和则失败
+    route.find_load("10.0.0.2:100")->begin_call();
+    for (size_t s = 0; s < sizeof(strategies) / sizeof(strategies[0]); ++s)
+        ASSERT_THAT(route.node(route.pick(kStrategyIdc | strategies[s])).node_, Eq("10.0.0.3:100"));
+
+    route.find_load("10.0.0.3:100")->begin_call();
+    ASSERT_THAT(route.pick(kStrategyIdc | kStrategyRoundRobin), Eq(-1));
+}
+
+TEST(zkRouteTest, RoutePickMultiTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    srv.nodes_["10.0.0.1:100"] = make_node("10.0.0.1:100", "aliyun", 60, 50);
+    srv.nodes_["10.0.0.2:100"] = make_node("10.0.0.2:100", "aliyun", 60, 50);
+    srv.nodes_["10.0.0.3:100"] = make_node("10.0.0.3:100", "aliyun", 50, 50);
+    srv.nodes_["10.0.0.4:100"] = make_node("10.0.0.4:100", "tencent", 50, 50);
+
+    ServiceRoute route(srv, "aliyun");
+
+    uint32_t strategies[] = { kStrategyWP, kStrategySWRR, kStrategyRandom, kStrategyRoundRobin, kStrategyP2C };
+    for (size_t s = 0; s < sizeof(strategies) / sizeof(strategies[0]); ++s) {
+        std::vector<uint32_t> result;
+        ASSERT_THAT(route.pick_multi(strategies[s], 10, std::set<std::string>(), result), Eq(0));
+        ASSERT_THAT(result.size(), Eq(4));
+        ASSERT_THAT(std::set<uint32_t>(result.begin(), result.end()).size(), Eq(4));
+    }
+
+    // 最高优先级的节点排在前面
+    std::vector<uint32_t> result;
+    ASSERT_THAT(route.pick_multi(kStrategyWP, 2, std::set<std::string>(), result), Eq(0));
+    ASSERT_THAT(route.node(result[0]).priority_, Eq(60));
+    ASSERT_THAT(route.node(result[1]).priority_, Eq(60));
+
+    // 排除本地IDC的全部节点之后，取消IDC筛选条件
+    std::set<std::string> exclude = { "10.0.0.1:100", "10.0.0.2:100", "10.0.0.3:100" };
+    ASSERT_THAT(route.pick_multi(kStrategyIdc | kStrategyWP, 2, exclude, result), Eq(0));
+    ASSERT_THAT(result.size(), Eq(1));
+    ASSERT_THAT(route.node(result[0]).node_, Eq("10.0.0.4:100"));
+
+    exclude.insert("10.0.0.4:100");
+    ASSERT_THAT(route.pick_multi(kStrategyWP, 2, exclude, result), Eq(-1));
+}
+
+TEST(zkRouteTest, RoutePickMultiSWRRTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    srv.nodes_["10.0.0.1:100"] = make_node("10.0.0.1:100", "aliyun", 60, 5);
+    srv.nodes_["10.0.0.2:100"] = make_node("10.0.0.2:100", "aliyun", 60, 1);
+    srv.nodes_["10.0.0.3:100"] = make_node("10.0.0.3:100", "aliyun", 60, 1);
+    srv.nodes_["10.0.0.4:100"] = make_node("10.0.0.4:100", "aliyun", 50, 1);
+
+    ServiceRoute route(srv, "aliyun");
+
+    // 最高优先级梯队全部被排除的时候不推进轮询状态，单个选择的序列不受影响
+    std::set<std::string> exclude = { "10.0.0.1:100", "10.0.0.2:100", "10.0.0.3:100" };
+    std::vector<uint32_t> result;
+    for (size_t i = 0; i < 3; ++i) {
+        ASSERT_THAT(route.pick_multi(kStrategySWRR, 1, exclude, result), Eq(0));
+        ASSERT_THAT(route.node(result[0]).node_, Eq("10.0.0.4:100"));
+    }
+
+    std::string sequence;
+    for (size_t i = 0; i < 7; ++i)
+        sequence += route.node(route.pick(kStrategySWRR)).node_.substr(7, 1);
+    ASSERT_THAT(sequence, Eq("1121311"));
+
+    // 被排除的节点不参与轮询，其余节点按照权重交替
+    exclude = { "10.0.0.1:100" };
+    sequence.clear();
+    for (size_t i = 0; i < 4; ++i) {
+        ASSERT_THAT(route.pick_multi(kStrategySWRR, 1, exclude, result), Eq(0));
+        sequence += route.node(result[0]).node_.substr(7, 1);
+    }
+    ASSERT_THAT(sequence, AnyOf(Eq("2323"), Eq("3232")));
+}
+
+TEST(zkRouteTest, RouteMasterTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    srv.nodes_["10.0.0.1:100"] = make_node("10.0.0.1:100", "aliyun", 50, 50);
+    srv.nodes_["10.0.0.2:100"] = make_node("10.0.0.2:100", "aliyun", 50, 50);
+    srv.nodes_["10.0.0.2:100"].properties_["pid"] = "1234";
+    srv.properties_["lock_master"] = "10.0.0.2-1234";
+
+    ServiceRoute route(srv, "aliyun");
+    int index = route.pick(kStrategyMaster);
+    ASSERT_THAT(index, Ge(0));
+    ASSERT_THAT(route.node(index).node_, Eq("10.0.0.2:100"));
+}
+
+TEST(zkRouteTest, RouteEndpointTest) {
+
+    ServiceType srv("dept", "srv_inst");
+    srv.nodes_["10.0.0.1:100"] = make_node("10.0.0.1:100", "aliyun", 50, 50);
+
+    ServiceRoute route(srv, "aliyun");
+    ASSERT_THAT(route.size(), Eq(1));
+
+    const Endpoint& endpoint = route.endpoint(0);
+    ASSERT_THAT(endpoint.port_, Eq(100));
+    ASSERT_THAT(ntohl(endpoint.addr_), Eq(0x0A000001u));
+    ASSERT_THAT(endpoint.id_, Eq((0x0A000001ull << 16) | 100));
+    ASSERT_THAT(endpoint.sockaddr_.sin_family, Eq(AF_INET));
+    ASSERT_THAT(ntohs(endpoint.sockaddr_.sin_port), Eq(100));
+    ASSERT_THAT(endpoint.sockaddr_.sin_addr.s_addr, Eq(endpoint.addr_));
+}
+
+}  // end Clotho
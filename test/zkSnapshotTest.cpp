@@ -0,0 +1,77 @@
+#include <gmock/gmock.h>
+#include <string>
+
+#include <cstdio>
+#include <fstream>
+
+#include "zkSnapshot.h"
+
+using namespace ::testing;
+
+namespace Clotho {
+
+static const char* kSnapshotFile = "/tmp/clotho_snapshot_test.dat";
+
+TEST(zkSnapshotTest, DumpLoadTest) {
+
+    MapServiceType services;
+
+    ServiceType srv("dept", "srv_inst", { { "enable", "1" }, { "conf", "a=b\nc" } });
+    srv.pick_strategy_ = 0x3;
+    srv.with_nodes_ = true;
+
+    NodeType node("dept", "srv_inst", "127.0.0.1:1222");
+    node.set_property("enable", "1");
+    node.set_property("active", "1");
+    node.set_property("weight", "80");
+    node.set_property("idc", "aliyun");
+    srv.nodes_[node.node_] = node;
+
+    services["/dept/srv_inst"] = srv;
+    services["/dept/srv_empty"] = ServiceType("dept", "srv_empty");
+
+    ASSERT_THAT(zkSnapshot::dump(kSnapshotFile, services), Eq(0));
+
+    MapServiceType loaded;
+    ASSERT_THAT(zkSnapshot::load(kSnapshotFile, loaded), Eq(0));
+    ASSERT_THAT(loaded.size(), Eq(2u));
+
+    const ServiceType& l_srv = loaded["/dept/srv_inst"];
+    ASSERT_THAT(l_srv.pick_strategy_, Eq(0x3u));
+    ASSERT_THAT(l_srv.with_nodes_, Eq(true));
+    ASSERT_THAT(l_srv.properties_.at("conf"), Eq("a=b\nc"));
+    ASSERT_THAT(l_srv.versions_.empty(), Eq(true));
+    ASSERT_THAT(l_srv.nodes_.size(), Eq(1u));
+
+    const NodeType& l_node = l_srv.nodes_.at("127.0.0.1:1222");
+    ASSERT_THAT(l_node.available(), Eq(true));
+    ASSERT_THAT(l_node.weight_, Eq(80));
+    ASSERT_THAT(l_node.idc_, Eq("aliyun"));
+    ASSERT_THAT(l_node.port_, Eq(1222));
+
+    ::remove(kSnapshotFile);
+}
+
+TEST(zkSnapshotTest, CorruptedTest) {
+
+    MapServiceType services;
+    services["/dept/srv_inst"] = ServiceType("dept", "srv_inst");
+    ASSERT_THAT(zkSnapshot::dump(kSnapshotFile, services), Eq(0));
+
+    // 修改最后一个字节，校验和不匹配
+    {
+        std::fstream fs(kSnapshotFile, std::ios::in | std::ios::out | std::ios::binary);
+        fs.seekp(-1, std::ios::end);
+        fs.put('x');
+    }
+
+    MapServiceType loaded;
+    loaded["/dept/other"] = ServiceType("dept", "other");
+    ASSERT_THAT(zkSnapshot::load(kSnapshotFile, loaded), Eq(-1));
+    ASSERT_THAT(loaded.size(), Eq(1u));
+
+    ::remove(kSnapshotFile);
+    ASSERT_THAT(zkSnapshot::load(kSnapshotFile, loaded), Eq(-1));
+}
+
+} // end namespace Clotho
@@ -7,6 +7,10 @@
 
 #include <vector>
 #include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <algorithm>
 
 #include <unistd.h>
 
@@ -29,10 +33,36 @@ namespace Clotho {
 
 const static int ZOO_BUFFER_LEN = 4 * 1024;
 
+// 会话重建的退避时间范围
+const static uint32_t kReconnectBackoffMinMs = 100;
+const static uint32_t kReconnectBackoffMaxMs = 30 * 1000;
+
 // 用于关闭对zookeeper回调的处理。主要是在客户端退出的时候，会进行
 // 节点的解注册等操作，处理这些事件没有意义了，而且还可能导致死锁等问题
 bool g_terminating_ = false;
 
+// watcher和异步请求的completion都在ZooKeeper的completion线程中执行
+static thread_local bool t_callback_thread_ = false;
+
+bool zkClient::in_callback_thread() {
+    return t_callback_thread_;
+}
+
+const char* zkClient::conn_state_str(ConnState state) {
+
+    if (state == ConnState::kConnecting) {
+        return "CONNECTING";
+    } else if (state == ConnState::kConnected) {
+        return "CONNECTED";
+    } else if (state == ConnState::kReconnecting) {
+        return "RECONNECTING";
+    } else if (state == ConnState::kClosed) {
+        return "CLOSED";
+    } else {
+        return "UNKNOWN";
+    }
+}
+
 const char* zkClient::zevent_str(int event) {
 
     if (event == ZOO_CREATED_EVENT) {
@@ -77,7 +107,13 @@ zkClient::zkClient(const std::string& hostline, const BizEventFunc& func,
     session_timeout_(session_timeout),
     biz_event_func_(func),
     zhandle_lock_(),
-    zhandle_(NULL) {
+    zhandle_(),
+    state_(ConnState::kConnecting),
+    reconnect_lock_(),
+    reconnect_cond_(),
+    reconnect_pending_(false),
+    reconnect_stop_(false),
+    reconnect_thread_() {
 
     for (size_t i = 0; i < hostline_.size(); ++i) {
         if (hostline_[i] == ';')
@@ -97,41 +133,120 @@ zkClient::zkClient(const std::string& hostline, const BizEventFunc& func,
 }
 
 zkClient::~zkClient() {
+    zk_close();
+}
 
-    std::lock_guard<std::mutex> lock(zhandle_lock_);
-    if (zhandle_) {
-        zookeeper_close(zhandle_);
-        zhandle_ = NULL;
+void zkClient::zk_close() {
+
+    {
+        std::lock_guard<std::mutex> lock(reconnect_lock_);
+        reconnect_stop_ = true;
     }
+    reconnect_cond_.notify_all();
+    if (reconnect_thread_.joinable() && reconnect_thread_.get_id() != std::this_thread::get_id())
+        reconnect_thread_.join();
+
+    std::lock_guard<std::mutex> lock(zhandle_lock_);
+    std::atomic_store(&zhandle_, std::shared_ptr<_zhandle>());
+    state_ = ConnState::kClosed;
 }
 
+int64_t zkClient::session_id() {
 
-// 如果连接异常，就会持有zhandle_lock_的互斥锁，那么上层对client的任何
-// 调用都会阻塞在此处
-int zkClient::handle_session_event(int type, int state, const char* path) {
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    if (!zhandle)
+        return 0;
 
-    std::lock_guard<std::mutex> lock(zhandle_lock_);
+    const clientid_t* id = zoo_client_id(zhandle.get());
+    return id ? id->client_id : 0;
+}
+
+bool zkClient::current_handle(const struct _zhandle* zh) const {
+    return std::atomic_load(&zhandle_).get() == zh;
+}
+
+// 会话有效期内的断线由ZooKeeper库自动重连，只有会话过期(或者认证失败)
+// 之后才需要重建句柄，这个工作交给后台线程，不能阻塞ZooKeeper的回调线程
+int zkClient::handle_session_event(int type, int state, const char* path) {
 
     if (state == ZOO_CONNECTING_STATE ||
         state == ZOO_ASSOCIATING_STATE) {
+        state_ = ConnState::kConnecting;
         return 0;
     }
 
-    if (state != ZOO_CONNECTED_STATE) {
-        while (true) {
-            if (zk_init() == 0)
-                break;
+    if (state == ZOO_CONNECTED_STATE) {
+        state_ = ConnState::kConnected;
+        return 0;
+    }
 
-            log_err("try for ZooKeeper connecting...");
-            int count = 5;
-            while (count != 0) {
-                ::sleep(count);
-            }
-        }
+    log_err("session lost with state %s, schedule reconnect.", zstate_str(state));
+    state_ = ConnState::kReconnecting;
+
+    {
+        std::lock_guard<std::mutex> lock(reconnect_lock_);
+        reconnect_pending_ = true;
     }
+    reconnect_cond_.notify_one();
     return 0;
 }
 
+void zkClient::start_reconnect_thread() {
+
+    std::lock_guard<std::mutex> lock(reconnect_lock_);
+    if (!reconnect_stop_ && !reconnect_thread_.joinable())
+        reconnect_thread_ = std::thread(&zkClient::reconnect_run, this);
+}
+
+void zkClient::zk_reconnect() {
+
+    start_reconnect_thread();
+    state_ = ConnState::kReconnecting;
+
+    {
+        std::lock_guard<std::mutex> lock(reconnect_lock_);
+        reconnect_pending_ = true;
+    }
+    reconnect_cond_.notify_one();
+}
+
+void zkClient::reconnect_run() {
+
+    std::mt19937 engine(std::random_device{}());
+
+    while (true) {
+
+        {
+            std::unique_lock<std::mutex> lock(reconnect_lock_);
+            reconnect_cond_.wait(lock, [this] { return reconnect_stop_ || reconnect_pending_; });
+            if (reconnect_stop_)
+                return;
+            reconnect_pending_ = false;
+        }
+
+        uint32_t backoff_ms = kReconnectBackoffMinMs;
+        while (!zk_init()) {
+
+            // 在[backoff/2, backoff]之间随机，避免大量客户端同时重连
+            std::uniform_int_distribution<uint32_t> jitter(backoff_ms / 2, backoff_ms);
+            uint32_t wait_ms = jitter(engine);
+            log_err("reconnect ZooKeeper failed, retry after %u ms.", wait_ms);
+
+            std::unique_lock<std::mutex> lock(reconnect_lock_);
+            if (reconnect_cond_.wait_for(lock, std::chrono::milliseconds(wait_ms),
+                                         [this] { return reconnect_stop_.load(); }))
+                return;
+
+            backoff_ms = std::min(backoff_ms * 2, kReconnectBackoffMaxMs);
+        }
+
+        log_info("ZooKeeper session rebuilt.");
+
+        // 新会话中没有原来的临时节点和watch，通知上层恢复
+        delegete_biz_event(ZOO_SESSION_EVENT, ZOO_CONNECTED_STATE, "");
+    }
+}
+
 int zkClient::delegete_biz_event(int type, int state, const char* path) {
     if (biz_event_func_) {
         return biz_event_func_(type, state, path);
@@ -144,6 +259,8 @@ int zkClient::delegete_biz_event(int type, int state, const char* path) {
 static void
 zkClient_watch_call(zhandle_t* zh, int type, int state, const char* path, void* watcher_ctx) {
 
+    t_callback_thread_ = true;
+
     log_info("event type %s, state %s, path %s",
               zkClient::zevent_str(type), zkClient::zstate_str(state), path);
 
@@ -156,6 +273,11 @@ zkClient_watch_call(zhandle_t* zh, int type, int state, const char* path, void*
     if (zk) {
         if (type == ZOO_SESSION_EVENT) {
             // 会话层的通知，zkClient处理
+            // 新句柄在zk_init中发布之前的事件也会被丢弃，其状态由zk_init自己设置
+            if (!zk->current_handle(zh)) {
+                log_info("discard session event of stale handle %p", zh);
+                return;
+            }
             zk->handle_session_event(type, state, path);
         } else {
             // 业务级别的事件通知，代理到zkFrame处理
@@ -164,6 +286,10 @@ zkClient_watch_call(zhandle_t* zh, int type, int state, const char* path, void*
     }
 }
 
+static void zkClient_close_handle(zhandle_t* zh) {
+    zookeeper_close(zh);
+}
+
 bool zkClient::zk_init() {
 
     if (hostline_.empty() || session_timeout_ <= 0)
@@ -172,27 +298,42 @@ bool zkClient::zk_init() {
     {
         std::lock_guard<std::mutex> lock(zhandle_lock_);
 
-        if (zhandle_) {
-            zookeeper_close(zhandle_);
-            zhandle_ = NULL;
-        }
+        // 已经关闭的客户端不再建立会话
+        if (reconnect_stop_)
+            return false;
+
+        // 旧的句柄在最后一个使用者释放之后才会被关闭
+        std::atomic_store(&zhandle_, std::shared_ptr<_zhandle>());
 
         // zoo_set_debug_level(ZOO_LOG_LEVEL_DEBUG);
         zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
 
-        zhandle_ = zookeeper_init(hostline_.c_str(), zkClient_watch_call, session_timeout_, NULL, this, 0);
-        if (!zhandle_) {
+        zhandle_t* raw = zookeeper_init(hostline_.c_str(), zkClient_watch_call, session_timeout_, NULL, this, 0);
+        if (!raw) {
             log_err("zookeeper_init failed. errno: %d:%s", errno, strerror(errno));
             return false;
         }
 
-        // 同步等待，直到连接完成
-        while (zoo_state(zhandle_) != ZOO_CONNECTED_STATE) {
-            log_info("wait zookeeper to be connectted. %d:%s", zoo_state(zhandle_), zstate_str(zoo_state(zhandle_)));
+        std::shared_ptr<_zhandle> zhandle(raw, zkClient_close_handle);
+
+        // 同步等待连接完成，最多等待一个会话超时时间
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(session_timeout_);
+        while (zoo_state(zhandle.get()) != ZOO_CONNECTED_STATE) {
+            if (reconnect_stop_ || std::chrono::steady_clock::now() >= deadline) {
+                log_err("wait zookeeper connect timeout. %d:%s", zoo_state(zhandle.get()), zstate_str(zoo_state(zhandle.get())));
+                return false;
+            }
+            log_info("wait zookeeper to be connectted. %d:%s", zoo_state(zhandle.get()), zstate_str(zoo_state(zhandle.get())));
             ::usleep(50 * 1000);
         }
+
+        std::atomic_store(&zhandle_, zhandle);
+        state_ = ConnState::kConnected;
     }
 
+    // 后台重连线程在第一次连接成功之后启动
+    start_reconnect_thread();
+
 #if 0
     // check service whether ok
     {
@@ -215,10 +356,10 @@ bool zkClient::zk_init() {
 
 int zkClient::zk_set(const char* path, const std::string& value, int version) {
 
-    std::lock_guard<std::mutex> lock(zhandle_lock_);
-    CHECK_ZHANDLE(zhandle_);
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
 
-    int ret = zoo_set(zhandle_, path, value.c_str(), value.size(), -1);
+    int ret = zoo_set(zhandle.get(), path, value.c_str(), value.size(), -1);
     if (ret < 0) {
         log_err("zoo_set %s:%s failed, ret: %s", path, value.c_str(), zerror(ret));
         return ret;
@@ -228,36 +369,51 @@ int zkClient::zk_set(const char* path, const std::string& value, int version) {
     return 0;
 }
 
+// 直接读取到value的存储中，按照ZOO_BUFFER_LEN预估第一次读取的长度，如果返回的
+// Stat.dataLength超出了缓冲区长度，按照实际长度重新读取，值在两次读取之间变大则再重试一次
+// 内容按照长度处理，可以存储二进制的数据
 int zkClient::zk_get(const char* path, std::string& value, int watch, struct Stat* stat) {
 
-    std::lock_guard<std::mutex> lock(zhandle_lock_);
-    CHECK_ZHANDLE(zhandle_);
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
 
-    char szbuffer[ZOO_BUFFER_LEN]{};
-    int buffer_len = ZOO_BUFFER_LEN;
-    int ret = zoo_get(zhandle_, path, watch, szbuffer, &buffer_len, stat);
-    if (ret < 0) {
-        log_err("zoo_get %s failed, ret: %s", path, zerror(ret));
-        return ret;
-    }
+    struct Stat local_stat {};
+    if (stat == NULL)
+        stat = &local_stat;
 
-    if (buffer_len < ZOO_BUFFER_LEN) {
-        szbuffer[buffer_len] = '\0';
-    } else {
-        szbuffer[ZOO_BUFFER_LEN - 1] = '\0';
+    int capacity = ZOO_BUFFER_LEN;
+    for (int retry = 0; retry < 3; ++retry) {
+
+        value.resize(capacity);
+        int buffer_len = capacity;
+        int ret = zoo_get(zhandle.get(), path, watch, &value[0], &buffer_len, stat);
+        if (ret < 0) {
+            log_err("zoo_get %s failed, ret: %s", path, zerror(ret));
+            value.clear();
+            return ret;
+        }
+
+        // 节点的数据为空的时候buffer_len为-1
+        if (stat->dataLength <= capacity) {
+            value.resize(buffer_len > 0 ? buffer_len : 0);
+            log_info("zoo_get %s success. length: %d", path, buffer_len);
+            return 0;
+        }
+
+        capacity = stat->dataLength;
     }
 
-    log_warning("zoo_get %s success. value: %s, bufferlen: %d", path, szbuffer, buffer_len);
-    value = szbuffer;
-    return 0;
+    log_err("zoo_get %s failed, value keeps growing, length: %d", path, capacity);
+    value.clear();
+    return ZMARSHALLINGERROR;
 }
 
 int zkClient::zk_exists(const char* path, int watch, struct Stat* stat) {
 
-    std::lock_guard<std::mutex> lock(zhandle_lock_);
-    CHECK_ZHANDLE(zhandle_);
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
 
-    int ret = zoo_exists(zhandle_, path, watch, stat);
+    int ret = zoo_exists(zhandle.get(), path, watch, stat);
     if (ret < 0) {
         if (ret == ZNONODE) // 不存在
             return 0;
@@ -272,14 +428,14 @@ int zkClient::zk_exists(const char* path, int watch, struct Stat* stat) {
 
 int zkClient::zk_create(const char* path, const std::string& value, const struct ACL_vector* acl, int flags) {
 
-    std::lock_guard<std::mutex> lock(zhandle_lock_);
-    CHECK_ZHANDLE(zhandle_);
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
 
     if (acl == NULL) {
         acl = &ZOO_OPEN_ACL_UNSAFE;
     }
 
-    int ret = zoo_create(zhandle_, path, value.c_str(), value.size(), acl, flags, NULL, 0);
+    int ret = zoo_create(zhandle.get(), path, value.c_str(), value.size(), acl, flags, NULL, 0);
     if (ret < 0) {
         if (ret ==  ZNODEEXISTS) {
             log_warning("path %s already exists!", path);
@@ -311,10 +467,10 @@ int zkClient::zk_create_or_update(const char* path, const std::string& value, co
 
 int zkClient::zk_delete(const char* path, int version) {
 
-    std::lock_guard<std::mutex> lock(zhandle_lock_);
-    CHECK_ZHANDLE(zhandle_);
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
 
-    int ret = zoo_delete(zhandle_, path, version);
+    int ret = zoo_delete(zhandle.get(), path, version);
     if (ret < 0) {
         log_err("zoo_delete %s failed, ret: %s", path, zerror(ret));
         return ret;
@@ -326,14 +482,16 @@ int zkClient::zk_delete(const char* path, int version) {
 
 
 
-int zkClient::zk_get_children(const char* path, int watch, std::vector<std::string>& children) {
+int zkClient::zk_get_children(const char* path, int watch, std::vector<std::string>& children,
+                              struct Stat* stat) {
 
-    std::lock_guard<std::mutex> lock(zhandle_lock_);
-    CHECK_ZHANDLE(zhandle_);
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
 
     struct String_vector children_vec {
     };
-    int ret = zoo_get_children(zhandle_, path, watch, &children_vec);
+    int ret = stat ? zoo_get_children2(zhandle.get(), path, watch, &children_vec, stat)
+                   : zoo_get_children(zhandle.get(), path, watch, &children_vec);
     if (ret < 0) {
         log_err("zoo_get_children %s failed, ret: %s", path, zerror(ret));
         return ret;
@@ -355,10 +513,10 @@ int zkClient::zk_get_children(const char* path, int watch, std::vector<std::stri
 
 int zkClient::zk_multi(int op_count, const zoo_op_t* ops, zoo_op_result_t* results) {
 
-    std::lock_guard<std::mutex> lock(zhandle_lock_);
-    CHECK_ZHANDLE(zhandle_);
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
 
-    int ret = zoo_multi(zhandle_, op_count, ops, results);
+    int ret = zoo_multi(zhandle.get(), op_count, ops, results);
     if (ret < 0) {
         log_err("zoo_multi failed, ret: %s, detail:", zerror(ret));
         for (int i = 0; i < op_count; i++)
@@ -370,4 +528,262 @@ int zkClient::zk_multi(int op_count, const zoo_op_t* ops, zoo_op_result_t* resul
     return 0;
 }
 
+
+int zkClient::zk_add_persistent_watch(const char* path) {
+
+#ifdef CLOTHO_PERSISTENT_WATCH
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
+
+    int ret = zoo_add_watch(zhandle.get(), path, ZOO_PERSISTENT_RECURSIVE, zkClient_watch_call, this);
+    if (ret != ZOK) {
+        log_err("zoo_add_watch %s failed, ret: %s", path, zerror(ret));
+        return ret;
+    }
+
+    log_info("zoo_add_watch %s success.", path);
+    return 0;
+#else
+    return ZUNIMPLEMENTED;
+#endif
+}
+
+int zkClient::zk_exists_batch(const std::vector<std::string>& paths, int watch,
+                              std::vector<int>& results, std::vector<struct Stat>* stats) {
+
+    results.assign(paths.size(), 0);
+    if (stats)
+        stats->assign(paths.size(), Stat());
+
+    // 回调线程中不能等待异步请求完成，退化为顺序请求
+    if (in_callback_thread()) {
+        for (size_t i = 0; i < paths.size(); ++i)
+            results[i] = zk_exists(paths[i].c_str(), watch, stats ? &(*stats)[i] : NULL);
+        return 0;
+    }
+
+    std::mutex lock;
+    std::condition_variable cond;
+    size_t pending = paths.size();
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        AsyncStatCall func = [&, i](int rc, const struct Stat* stat) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (rc == ZOK) {
+                results[i] = 1;
+                if (stats && stat)
+                    (*stats)[i] = *stat;
+            } else {
+                results[i] = (rc == ZNONODE) ? 0 : rc;
+            }
+            if (--pending == 0)
+                cond.notify_all();
+        };
+
+        int code = zk_aexists(paths[i].c_str(), watch, func);
+        if (code != 0)
+            func(code, NULL);
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    cond.wait(guard, [&] { return pending == 0; });
+    return 0;
+}
+
+
+// 异步请求的回调函数在堆上分配，作为请求的上下文传递给ZooKeeper，在completion中释放
+// 连接关闭的时候未完成的请求也会以ZCLOSING等错误码回调，所以不会泄漏
+
+static void zkClient_data_completion(int rc, const char* value, int value_len,
+                                     const struct Stat* stat, const void* data) {
+
+    t_callback_thread_ = true;
+    std::unique_ptr<AsyncDataCall> func(static_cast<AsyncDataCall*>(const_cast<void*>(data)));
+
+    std::string result{};
+    if (rc == ZOK && value != NULL && value_len > 0)
+        result.assign(value, value_len);
+
+    (*func)(rc, result, rc == ZOK ? stat : NULL);
+}
+
+static void zkClient_children_completion(int rc, const struct String_vector* strings,
+                                         const struct Stat* stat, const void* data) {
+
+    t_callback_thread_ = true;
+    std::unique_ptr<AsyncChildrenCall> func(static_cast<AsyncChildrenCall*>(const_cast<void*>(data)));
+
+    std::vector<std::string> children{};
+    if (rc == ZOK && strings != NULL && strings->count > 0) {
+        children.reserve(strings->count);
+        for (int index = 0; index < strings->count; index++)
+            children.push_back(std::string(strings->data[index]));
+    }
+
+    (*func)(rc, children, rc == ZOK ? stat : NULL);
+}
+
+static void zkClient_stat_completion(int rc, const struct Stat* stat, const void* data) {
+
+    t_callback_thread_ = true;
+    std::unique_ptr<AsyncStatCall> func(static_cast<AsyncStatCall*>(const_cast<void*>(data)));
+    (*func)(rc, rc == ZOK ? stat : NULL);
+}
+
+static void zkClient_string_completion(int rc, const char* value, const void* data) {
+
+    t_callback_thread_ = true;
+    std::unique_ptr<AsyncCreateCall> func(static_cast<AsyncCreateCall*>(const_cast<void*>(data)));
+    (*func)(rc, (rc == ZOK && value != NULL) ? std::string(value) : std::string());
+}
+
+static void zkClient_void_completion(int rc, const void* data) {
+
+    t_callback_thread_ = true;
+    std::unique_ptr<AsyncVoidCall> func(static_cast<AsyncVoidCall*>(const_cast<void*>(data)));
+    (*func)(rc);
+}
+
+
+int zkClient::zk_aget(const char* path, int watch, const AsyncDataCall& func) {
+
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
+
+    AsyncDataCall* ctx = new AsyncDataCall(func);
+    int ret = zoo_aget(zhandle.get(), path, watch, zkClient_data_completion, ctx);
+    if (ret != ZOK) {
+        log_err("zoo_aget %s failed, ret: %s", path, zerror(ret));
+        delete ctx;
+        return ret;
+    }
+
+    return 0;
+}
+
+int zkClient::zk_aget_children(const char* path, int watch, const AsyncChildrenCall& func) {
+
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
+
+    AsyncChildrenCall* ctx = new AsyncChildrenCall(func);
+    int ret = zoo_aget_children2(zhandle.get(), path, watch, zkClient_children_completion, ctx);
+    if (ret != ZOK) {
+        log_err("zoo_aget_children2 %s failed, ret: %s", path, zerror(ret));
+        delete ctx;
+        return ret;
+    }
+
+    return 0;
+}
+
+int zkClient::zk_acreate(const char* path, const std::string& value, const struct ACL_vector* acl, int flags,
+                         const AsyncCreateCall& func) {
+
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
+
+    if (acl == NULL) {
+        acl = &ZOO_OPEN_ACL_UNSAFE;
+    }
+
+    AsyncCreateCall* ctx = new AsyncCreateCall(func);
+    int ret = zoo_acreate(zhandle.get(), path, value.c_str(), value.size(), acl, flags,
+                          zkClient_string_completion, ctx);
+    if (ret != ZOK) {
+        log_err("zoo_acreate %s failed, ret: %s", path, zerror(ret));
+        delete ctx;
+        return ret;
+    }
+
+    return 0;
+}
+
+int zkClient::zk_aset(const char* path, const std::string& value, int version, const AsyncStatCall& func) {
+
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
+
+    AsyncStatCall* ctx = new AsyncStatCall(func);
+    int ret = zoo_aset(zhandle.get(), path, value.c_str(), value.size(), version,
+                       zkClient_stat_completion, ctx);
+    if (ret != ZOK) {
+        log_err("zoo_aset %s failed, ret: %s", path, zerror(ret));
+        delete ctx;
+        return ret;
+    }
+
+    return 0;
+}
+
+int zkClient::zk_aexists(const char* path, int watch, const AsyncStatCall& func) {
+
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
+
+    AsyncStatCall* ctx = new AsyncStatCall(func);
+    int ret = zoo_aexists(zhandle.get(), path, watch, zkClient_stat_completion, ctx);
+    if (ret != ZOK) {
+        log_err("zoo_aexists %s failed, ret: %s", path, zerror(ret));
+        delete ctx;
+        return ret;
+    }
+
+    return 0;
+}
+
+int zkClient::zk_adelete(const char* path, int version, const AsyncVoidCall& func) {
+
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
+
+    AsyncVoidCall* ctx = new AsyncVoidCall(func);
+    int ret = zoo_adelete(zhandle.get(), path, version, zkClient_void_completion, ctx);
+    if (ret != ZOK) {
+        log_err("zoo_adelete %s failed, ret: %s", path, zerror(ret));
+        delete ctx;
+        return ret;
+    }
+
+    return 0;
+}
+
+int zkClient::zk_amulti(int op_count, const zoo_op_t* ops, zoo_op_result_t* results,
+                        const AsyncVoidCall& func) {
+
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
+
+    AsyncVoidCall* ctx = new AsyncVoidCall(func);
+    int ret = zoo_amulti(zhandle.get(), op_count, ops, results, zkClient_void_completion, ctx);
+    if (ret != ZOK) {
+        log_err("zoo_amulti failed, ret: %s", zerror(ret));
+        delete ctx;
+        return ret;
+    }
+
+    return 0;
+}
+
+int zkClient::zk_aadd_persistent_watch(const char* path, const AsyncVoidCall& func) {
+
+#ifdef CLOTHO_PERSISTENT_WATCH
+    std::shared_ptr<_zhandle> zhandle = std::atomic_load(&zhandle_);
+    CHECK_ZHANDLE(zhandle.get());
+
+    AsyncVoidCall* ctx = new AsyncVoidCall(func);
+    int ret = zoo_aadd_watch(zhandle.get(), path, ZOO_PERSISTENT_RECURSIVE, zkClient_watch_call, this,
+                             zkClient_void_completion, ctx);
+    if (ret != ZOK) {
+        log_err("zoo_aadd_watch %s failed, ret: %s", path, zerror(ret));
+        delete ctx;
+        return ret;
+    }
+
+    return 0;
+#else
+    return ZUNIMPLEMENTED;
+#endif
+}
+
 } // Clotho
@@ -14,6 +14,10 @@
 
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
 
 // 使用ZooKeeper客户端库和ZooKeeper Server通信的封装
 
@@ -29,6 +33,22 @@ namespace Clotho {
 
 typedef std::function<int(int, int, const char*)> BizEventFunc;
 
+// 客户端的连接状态
+enum class ConnState : int {
+    kConnecting   = 1,  // 初始连接，或者会话有效期内断线由ZooKeeper库自动重连
+    kConnected    = 2,
+    kReconnecting = 3,  // 会话已经过期，后台线程正在重建会话
+    kClosed       = 4,
+};
+
+// 异步请求的完成回调，第一个参数为ZooKeeper的返回码(ZOK表示成功)，失败时候其他参数无效
+// 回调在ZooKeeper的completion线程中执行，不能在回调中阻塞等待其他异步请求的完成
+typedef std::function<void(int, const std::string&, const struct Stat*)>              AsyncDataCall;
+typedef std::function<void(int, const std::vector<std::string>&, const struct Stat*)> AsyncChildrenCall;
+typedef std::function<void(int, const struct Stat*)>                                  AsyncStatCall;
+typedef std::function<void(int, const std::string&)>                                  AsyncCreateCall;
+typedef std::function<void(int)>                                                      AsyncVoidCall;
+
 class zkClient {
 
 public:
@@ -42,12 +62,39 @@ public:
     static const char* zevent_str(int event);
     static const char* zstate_str(int state);
 
+    // 当前是否是ZooKeeper的回调线程，在回调线程中不能阻塞等待异步请求的完成
+    static bool in_callback_thread();
+
+    static const char* conn_state_str(ConnState state);
 
     // 该函数是可重复调用的，当会话断开的时候使用这个来重建会话
+    // 最多等待session_timeout的时间连接完成，超时返回失败
     bool zk_init();
+
+    // 在后台线程中建立会话，用于初始连接失败但是调用方可以继续工作的情况
+    void zk_reconnect();
+
+    // 关闭会话并停止重连，在途的异步请求以ZCLOSING完成，等待它们的调用者会立即返回
+    void zk_close();
+
+    // 会话事件在ZooKeeper的回调线程中执行，这里只更新状态并通知后台的重连线程
     int handle_session_event(int type, int state, const char* path);
     int delegete_biz_event(int type, int state, const char* path);
 
+    // 会话过期之后收到的旧句柄事件需要丢弃
+    bool current_handle(const struct _zhandle* zh) const;
+
+    ConnState conn_state() const {
+        return state_.load();
+    }
+
+    bool connected() const {
+        return state_.load() == ConnState::kConnected;
+    }
+
+    // 当前会话的ID，和临时节点Stat中的ephemeralOwner对应，没有会话返回0
+    int64_t session_id();
+
     int zk_create_if_nonexists(const char* path, const std::string& value, const struct ACL_vector* acl, int flags);
     int zk_create_or_update(const char* path, const std::string& value, const struct ACL_vector* acl, int flags);
     int zk_create(const char* path, const std::string& value, const struct ACL_vector* acl, int flags);
@@ -59,10 +106,38 @@ public:
 
     // 1 存在，0不存在，其他请求失败
     int zk_exists(const char* path, int watch, struct Stat* stat);
-    int zk_get_children(const char* path, int watch, std::vector<std::string>& children);
+    // stat不为空的时候使用zoo_get_children2，同时返回目录的Stat(包括cversion)
+    int zk_get_children(const char* path, int watch, std::vector<std::string>& children,
+                        struct Stat* stat = NULL);
 
     int zk_multi(int op_count, const struct zoo_op* ops, struct zoo_op_result* results);
 
+    // 在path上添加持久递归watch(ZooKeeper 3.6+)，path及其全部子路径的变更事件都会通知，
+    // 并且不需要重新设置。编译时没有定义CLOTHO_PERSISTENT_WATCH返回ZUNIMPLEMENTED
+    int zk_add_persistent_watch(const char* path);
+
+    // 批量检查节点是否存在，请求并行发出之后等待全部完成，results中1存在，0不存在，其他为错误码
+    // stats不为空的时候同时返回节点的Stat，不存在的节点内容无效
+    int zk_exists_batch(const std::vector<std::string>& paths, int watch,
+                        std::vector<int>& results, std::vector<struct Stat>* stats = NULL);
+
+    // 异步接口，请求提交之后立即返回，可以同时有多个请求在途
+    // 返回0表示提交成功，结果通过回调通知；提交失败返回错误码，回调不会被调用
+    int zk_aget(const char* path, int watch, const AsyncDataCall& func);
+    int zk_aget_children(const char* path, int watch, const AsyncChildrenCall& func);
+    int zk_acreate(const char* path, const std::string& value, const struct ACL_vector* acl, int flags,
+                   const AsyncCreateCall& func);
+    int zk_aset(const char* path, const std::string& value, int version, const AsyncStatCall& func);
+    // 节点不存在的时候回调的返回码为ZNONODE
+    int zk_aexists(const char* path, int watch, const AsyncStatCall& func);
+    int zk_adelete(const char* path, int version, const AsyncVoidCall& func);
+    // zk_add_persistent_watch的异步版本，同一个会话中的请求按顺序处理，
+    // 之后立即发出的读取请求不会错过变更
+    int zk_aadd_persistent_watch(const char* path, const AsyncVoidCall& func);
+    // results需要保持有效直到回调完成
+    int zk_amulti(int op_count, const struct zoo_op* ops, struct zoo_op_result* results,
+                  const AsyncVoidCall& func);
+
 private:
 
     // conf
@@ -73,9 +148,24 @@ private:
 
     std::function<int(int, int, const char*)> biz_event_func_;
 
-    // internal handle and sync
+    // ZooKeeper多线程版本的句柄本身是线程安全的，这里使用引用计数的句柄
+    // 通过std::atomic_load读取，请求之间可以并行执行，zhandle_lock_只用来串行化zk_init
     std::mutex                zhandle_lock_;
-    struct _zhandle*          zhandle_;
+    std::shared_ptr<_zhandle> zhandle_;
+
+    std::atomic<ConnState>    state_;
+
+    // 会话过期后的重连在后台线程中按照带随机抖动的指数退避进行，重连期间
+    // 不持有任何锁，其他请求使用旧句柄直接失败返回，上层继续使用缓存的路由
+    // 重连成功之后通过biz_event_func_投递一个ZOO_SESSION_EVENT通知上层恢复
+    void reconnect_run();
+    void start_reconnect_thread();
+
+    std::mutex                reconnect_lock_;
+    std::condition_variable   reconnect_cond_;
+    bool                      reconnect_pending_;
+    std::atomic<bool>         reconnect_stop_;
+    std::thread               reconnect_thread_;
 };
 
 } // end namespace Clotho
@@ -0,0 +1,129 @@
+/*-
+ * Copyright (c) 2019 TAO Zhijiang<taozhijiang@gmail.com>
+ *
+ * Licensed under the BSD-3-Clause license, see LICENSE for full information.
+ *
+ */
+
+#include "zkPath.h"
+#include "zkEvent.h"
+
+namespace Clotho {
+
+zkEventQueue::zkEventQueue(size_t workers, const EventHandler& handler, uint32_t window_ms) :
+    handler_(handler),
+    window_(window_ms),
+    shards_(),
+    depth_(0),
+    coalesced_(0),
+    terminating_(false) {
+
+    if (workers == 0)
+        workers = 1;
+
+    for (size_t i = 0; i < workers; ++i)
+        shards_.emplace_back(new Shard());
+}
+
+zkEventQueue::~zkEventQueue() {
+    stop();
+}
+
+bool zkEventQueue::start() {
+
+    if (!handler_) {
+        log_err("event handler not provided.");
+        return false;
+    }
+
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        Shard& shard = *shards_[i];
+        shard.thread_ = std::thread(&zkEventQueue::run, this, std::ref(shard));
+    }
+
+    log_info("event queue started with %d workers.", static_cast<int>(shards_.size()));
+    return true;
+}
+
+void zkEventQueue::stop() {
+
+    terminating_ = true;
+
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        Shard& shard = *shards_[i];
+        {
+            std::lock_guard<std::mutex> lock(shard.lock_);
+            shard.cond_.notify_all();
+        }
+
+        if (shard.thread_.joinable())
+            shard.thread_.join();
+    }
+}
+
+std::string zkEventQueue::service_key(const std::string& path) {
+
+    // /dept/service/...
+    size_t pos = path.find('/', 1);
+    if (pos == std::string::npos)
+        return path;
+
+    pos = path.find('/', pos + 1);
+    if (pos == std::string::npos)
+        return path;
+
+    return path.substr(0, pos);
+}
+
+void zkEventQueue::push(int type, int state, const std::string& path) {
+
+    if (terminating_)
+        return;
+
+    size_t index = std::hash<std::string>()(service_key(path)) % shards_.size();
+    Shard& shard = *shards_[index];
+
+    std::lock_guard<std::mutex> lock(shard.lock_);
+    if (!shard.pending_.insert(std::make_pair(type, path)).second) {
+        ++coalesced_;
+        return;
+    }
+
+    shard.events_.push_back(Event{ type, state, path, Clock::now() + window_ });
+    ++depth_;
+    shard.cond_.notify_one();
+}
+
+void zkEventQueue::run(Shard& shard) {
+
+    while (true) {
+
+        Event event;
+        {
+            std::unique_lock<std::mutex> lock(shard.lock_);
+            shard.cond_.wait(lock, [&] { return terminating_ || !shard.events_.empty(); });
+
+            // 窗口相同，队列中事件的ready_是递增的，只需要等待队首
+            while (!terminating_ && Clock::now() < shard.events_.front().ready_)
+                shard.cond_.wait_until(lock, shard.events_.front().ready_);
+
+            if (terminating_) {
+                depth_ -= shard.events_.size();
+                shard.events_.clear();
+                shard.pending_.clear();
+                break;
+            }
+
+            event = std::move(shard.events_.front());
+            shard.events_.pop_front();
+
+            // 开始处理之后的新事件需要再次入队
+            shard.pending_.erase(std::make_pair(event.type_, event.path_));
+        }
+
+        handler_(event.type_, event.state_, event.path_.c_str());
+        --depth_;
+    }
+}
+
+} // Clotho
@@ -0,0 +1,98 @@
+/*-
+ * Copyright (c) 2019 TAO Zhijiang<taozhijiang@gmail.com>
+ *
+ * Licensed under the BSD-3-Clause license, see LICENSE for full information.
+ *
+ */
+
+#ifndef __CLOTHO_EVENT_H__
+#define __CLOTHO_EVENT_H__
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+#include <deque>
+#include <vector>
+#include <set>
+#include <string>
+#include <chrono>
+#include <memory>
+#include <functional>
+
+// ZooKeeper的回调线程只负责把事件放入队列，事件的处理(可能包含同步的ZooKeeper请求
+// 以及用户的属性回调)都在独立的工作线程中执行，不会阻塞其他事件和异步请求的回调
+//
+// 事件的处理都是重新读取最新的数据，所以相同路径、相同类型的事件如果已经在队列中等待，
+// 新的事件直接合并掉；正在处理中的事件不参与合并，保证之后的变更会再处理一次。
+// window_ms 为事件入队之后延迟处理的时间，在这个窗口内的重复事件都会被合并
+
+namespace Clotho {
+
+typedef std::function<int(int, int, const char*)> EventHandler;
+
+class zkEventQueue {
+
+public:
+    zkEventQueue(size_t workers, const EventHandler& handler, uint32_t window_ms = 0);
+    ~zkEventQueue();
+
+    // 禁止拷贝
+    zkEventQueue(const zkEventQueue&) = delete;
+    zkEventQueue& operator=(const zkEventQueue&) = delete;
+
+    bool start();
+
+    // 停止并等待全部工作线程退出，尚未处理的事件被丢弃
+    void stop();
+
+    // 同一个服务(/dept/service)下的事件总是分派到同一个工作线程，保证处理的顺序
+    void push(int type, int state, const std::string& path);
+
+    // 尚未处理完成的事件数目
+    size_t depth() const {
+        return depth_.load(std::memory_order_relaxed);
+    }
+
+    // 被合并掉的事件数目
+    size_t coalesced() const {
+        return coalesced_.load(std::memory_order_relaxed);
+    }
+
+    // 从路径中截取服务路径作为分派的键
+    static std::string service_key(const std::string& path);
+
+private:
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Event {
+        int               type_;
+        int               state_;
+        std::string       path_;
+        Clock::time_point ready_;   // 可以开始处理的时间
+    };
+
+    struct Shard {
+        std::mutex              lock_;
+        std::condition_variable cond_;
+        std::deque<Event>       events_;
+        std::set<std::pair<int, std::string>> pending_;    // 队列中等待的事件，用于合并
+        std::thread             thread_;
+    };
+
+    void run(Shard& shard);
+
+    const EventHandler handler_;
+    const std::chrono::milliseconds window_;
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<size_t> depth_;
+    std::atomic<size_t> coalesced_;
+    std::atomic<bool>   terminating_;
+};
+
+} // Clotho
+
+#endif // __CLOTHO_EVENT_H__
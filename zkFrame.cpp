@@ -10,6 +10,8 @@
 
 #include <cassert>
 #include <algorithm>
+#include <condition_variable>
+#include <fstream>
 #include <zookeeper/zookeeper.h>
 
 #include "zkFrame.h"
@@ -17,6 +19,7 @@
 namespace Clotho {
 
 zkFrame::zkFrame(const std::string& idc) :
+    events_(),
     client_(),
     recipe_(),
     idc_(idc),
@@ -24,7 +27,17 @@ zkFrame::zkFrame(const std::string& idc) :
     whole_nodes_addr_(),
     lock_(),
     pub_nodes_(),
-    sub_services_() {
+    sub_services_(),
+    restore_nodes_(),
+    persistent_services_(),
+    persistent_watch_supported_(true),
+    sub_snapshots_(),
+    snapshot_version_(0),
+    snapshot_file_(),
+    stale_(false),
+    stale_services_(),
+    bulk_lock_(),
+    bulk_fetches_() {
 
     auto local_ips = zkPath::get_local_ips();
     if (local_ips.empty()) {
@@ -48,48 +61,156 @@ zkFrame::~zkFrame() {
     g_terminating_ = true;
 
     std::string expect = primary_node_addr_ + "-" + Clotho::to_string(::getpid());
-    recipe_->revoke_all_locks(expect);
+    if (recipe_)
+        recipe_->revoke_all_locks(expect);
+
+    // 关闭会话让在途的请求以ZCLOSING完成，否则阻塞在ServiceFetcher::wait中的
+    // 事件处理可能一直无法返回，导致停止事件队列的时候无法join
+    if (client_)
+        client_->zk_close();
+
+    // 工作线程中的事件处理会访问client_，需要先停止
+    if (events_)
+        events_->stop();
+
+    // 在途的异步请求回调中会使用client_
+    reap_bulk_fetches(true);
 
     std::lock_guard<std::mutex> lock(lock_);
     client_.reset();
 }
 
 
-bool zkFrame::init(const std::string& hostline) {
+// 初始化时批量订阅清单中服务的超时时间
+static const uint32_t kManifestTimeoutMs = 10 * 1000;
+
+bool zkFrame::init(const std::string& hostline, size_t event_workers, uint32_t event_window_ms,
+                   const std::string& snapshot_file, const std::string& manifest_file) {
 
     if (hostline.empty() || idc_.empty() ||
         whole_nodes_addr_.empty() || primary_node_addr_.empty()) {
         return false;
     }
 
-    auto func = std::bind(&zkFrame::handle_zk_event, this,
-                          std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+    std::vector<ServiceSubscription> manifest{};
+    if (!manifest_file.empty() && load_manifest(manifest_file, manifest) != 0) {
+        log_err("load manifest %s failed.", manifest_file.c_str());
+        return false;
+    }
 
-    client_.reset(new zkClient(hostline, func, idc_));
-    if (!client_ || !client_->zk_init()) {
-        log_err("create and init zkClient failed.");
-        client_.reset();
+    // 事件处理线程启动之前准备好本地数据
+    pub_nodes_ = std::make_shared<MapNodeType>();
+    sub_services_ = std::make_shared<MapServiceType>();
+    sub_snapshots_ = std::make_shared<const MapServiceSlot>();
+
+    if (!pub_nodes_ || !sub_services_ || !sub_snapshots_) {
         return false;
     }
 
+    // 加载本地快照，在连接ZooKeeper之前就可以选择节点
+    snapshot_file_ = snapshot_file;
+    if (!snapshot_file_.empty() && zkSnapshot::load(snapshot_file_, *sub_services_) == 0) {
+        std::lock_guard<std::mutex> lock(lock_);
+        for (auto iter = sub_services_->begin(); iter != sub_services_->end(); ++iter) {
+            publish_service(iter->first);
+            stale_services_.insert(iter->first);
+        }
+
+        stale_ = !sub_services_->empty();
+        log_info("load %d services from snapshot %s",
+                 static_cast<int>(sub_services_->size()), snapshot_file_.c_str());
+    }
+
     recipe_.reset(new zkRecipe(*this));
     if (!recipe_) {
         log_err("create zkRecipe failed.");
         return false;
     }
 
-    pub_nodes_ = std::make_shared<MapNodeType>();
-    sub_services_ = std::make_shared<MapServiceType>();
+    auto handler = std::bind(&zkFrame::handle_zk_event, this,
+                             std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+
+    events_.reset(new zkEventQueue(event_workers, handler, event_window_ms));
+    if (!events_ || !events_->start()) {
+        log_err("create and start event queue failed.");
+        events_.reset();
+        return false;
+    }
+
+    // ZooKeeper的回调线程只负责事件入队
+    auto func = [this](int type, int state, const char* path) -> int {
+        events_->push(type, state, path ? path : "");
+        return 0;
+    };
+
+    client_.reset(new zkClient(hostline, func, idc_));
+    if (!client_) {
+        log_err("create zkClient failed.");
+        return false;
+    }
+
+    if (!client_->zk_init()) {
+
+        // 有可用的快照时继续使用，在后台连接ZooKeeper，连接成功之后重新订阅
+        if (stale_) {
+            log_warning("init zkClient failed, serve stale snapshot and reconnect in background.");
+
+            // 清单中有但是快照中没有的服务，登记之后在重连成功的时候一起获取
+            std::lock_guard<std::mutex> lock(lock_);
+            for (size_t i = 0; i < manifest.size(); ++i) {
+                std::string service_path = zkPath::make_path(manifest[i].department_, manifest[i].service_);
+                if (sub_services_->find(service_path) != sub_services_->end())
+                    continue;
 
-    if (!pub_nodes_ || !sub_services_) {
+                ServiceType srv(manifest[i].department_, manifest[i].service_);
+                srv.pick_strategy_ = manifest[i].strategy_ ? manifest[i].strategy_ : kStrategyDefault;
+                srv.with_nodes_ = manifest[i].with_nodes_;
+                (*sub_services_)[service_path] = srv;
+                stale_services_.insert(service_path);
+            }
+
+            client_->zk_reconnect();
+            return true;
+        }
+
+        log_err("init zkClient failed.");
+        client_.reset();
         return false;
     }
 
+    // 快照中的服务和清单一起重新获取并设置watch，失败或者超时的服务继续使用快照，
+    // 之后由periodicly_care或者后台的批量请求完成同步
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        std::set<std::string> listed{};
+        for (size_t i = 0; i < manifest.size(); ++i)
+            listed.insert(zkPath::make_path(manifest[i].department_, manifest[i].service_));
+
+        for (auto iter = stale_services_.begin(); iter != stale_services_.end(); ++iter) {
+            auto srv = sub_services_->find(*iter);
+            if (srv == sub_services_->end() || listed.find(*iter) != listed.end())
+                continue;
+
+            ServiceSubscription subscription {};
+            subscription.department_ = srv->second.department_;
+            subscription.service_ = srv->second.service_;
+            subscription.strategy_ = srv->second.pick_strategy_;
+            subscription.with_nodes_ = srv->second.with_nodes_;
+            manifest.push_back(subscription);
+        }
+    }
+
+    if (!manifest.empty() && subscribe_services(manifest, kManifestTimeoutMs) != 0)
+        log_warning("some services in manifest %s or snapshot not subscribed.", manifest_file.c_str());
+
     return true;
 }
 
 
-int zkFrame::register_node(const NodeType& node, bool overwrite) {
+// 注册过程中和其他客户端并发创建、删除路径导致事务失败的重试次数
+static const int kRegisterRetry = 3;
+
+int zkFrame::register_node(const NodeType& node, bool overwrite, bool packed) {
 
     std::vector<NodeType> nodes;
     if (substitute_node(node, nodes) != 0) {
@@ -97,6 +218,13 @@ int zkFrame::register_node(const NodeType& node, bool overwrite) {
         return -1;
     }
 
+    // 全部实体节点的路径放到一个事务中创建，部门和服务路径在节点之间共享只需要一份
+    VectorPair persist_paths{};
+    VectorPair packed_paths{};
+    std::vector<VectorPair> ephemeral_paths{};
+    std::set<std::string> unique_paths{};
+    std::vector<NodeType> valid_nodes{};
+
     for (size_t i = 0; i < nodes.size(); ++i) {
 
         VectorPair paths{};
@@ -105,49 +233,271 @@ int zkFrame::register_node(const NodeType& node, bool overwrite) {
             continue;
         }
 
+        std::string full_node_path = zkPath::make_path(nodes[i].department_, nodes[i].service_, nodes[i].node_);
+        std::map<std::string, std::string> packed_properties = { { "enable", "1" } };
+
         for (auto iter = paths.begin(); iter != paths.end(); ++iter) {
             PathType tp = zkPath::guess_path_type(iter->first);
-            if (tp == PathType::kDepartment || tp == PathType::kService || tp == PathType::kNode) {
-                client_->zk_create_if_nonexists(iter->first.c_str(), iter->second, &ZOO_OPEN_ACL_UNSAFE, 0);
-            } else if (tp == PathType::kServiceProperty || tp == PathType::kNodeProperty) {
-                if (overwrite)
-                    client_->zk_create_or_update(iter->first.c_str(), iter->second, &ZOO_OPEN_ACL_UNSAFE, 0);
-                else
-                    client_->zk_create_if_nonexists(iter->first.c_str(), iter->second, &ZOO_OPEN_ACL_UNSAFE, 0);
+            if (packed && tp == PathType::kNodeProperty) {
+                std::string d, srv, n, property;
+                if (NodeType::node_property_parse(iter->first.c_str(), d, srv, n, property))
+                    packed_properties[property] = iter->second;
+            } else if (packed && tp == PathType::kNode) {
+                continue;
+            } else if (tp == PathType::kDepartment || tp == PathType::kService || tp == PathType::kNode ||
+                       tp == PathType::kServiceProperty || tp == PathType::kNodeProperty) {
+                if (unique_paths.insert(iter->first).second)
+                    persist_paths.push_back(*iter);
             } else {
                 log_err("Unknown PathType for %s", iter->first.c_str());
             }
         }
 
-        std::string full_node_path = zkPath::make_path(nodes[i].department_, nodes[i].service_, nodes[i].node_);
+        if (packed) {
+            if (!overwrite && merge_packed_properties(full_node_path, packed_properties) != 0) {
+                log_err("merge packed properties for %s failed.", full_node_path.c_str());
+                continue;
+            }
+
+            packed_paths.emplace_back(full_node_path, zkPath::pack_properties(packed_properties));
+        }
 
         // add additional active path, EPHEMERAL node here
-        std::string active_path = zkPath::extend_property(full_node_path, "active");
-        if (client_->zk_create(active_path.c_str(), "1", &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL) != 0) {
-            log_err("Create EPHEMERAL active failed, cirital error: %s", active_path.c_str());
+        // additional non-critial pid
+        ephemeral_paths.push_back(ephemeral_node_paths(full_node_path));
+
+        valid_nodes.push_back(nodes[i]);
+    }
+
+    if (valid_nodes.empty()) {
+        log_err("no valid node to register for %s", node.node_.c_str());
+        return -1;
+    }
+
+    int code = -1;
+    std::vector<bool> registered{};
+    for (int retry = 0; retry < kRegisterRetry; ++retry) {
+        code = multi_register(persist_paths, packed_paths, ephemeral_paths, overwrite, registered);
+        if (code != ZNODEEXISTS && code != ZNONODE)
+            break;
+
+        log_warning("register node %s conflicts with concurrent modification, retry %d",
+                    node.node_.c_str(), retry);
+    }
+
+    if (code != 0) {
+        log_err("register node %s failed, code %d", node.node_.c_str(), code);
+        return -1;
+    }
+
+    // 只跳过被其他会话占用的节点，其他节点正常注册
+    size_t count = 0;
+    for (size_t i = 0; i < valid_nodes.size(); ++i) {
+
+        if (!registered[i])
+            continue;
+
+        // 执行添加操作
+        std::string full = zkPath::make_path(valid_nodes[i].department_, valid_nodes[i].service_, valid_nodes[i].node_);
+        full = zkPath::normalize_path(full);
+
+        std::lock_guard<std::mutex> lock(lock_);
+        (*pub_nodes_)[full] = valid_nodes[i];
+        ++count;
+
+        log_info("successfully add %s into pub_nodes_", full.c_str());
+    }
+
+    return count > 0 ? 0 : -1;
+}
+
+VectorPair zkFrame::ephemeral_node_paths(const std::string& node_path) {
+
+    VectorPair paths{};
+    paths.emplace_back(zkPath::extend_property(node_path, "active"), "1");
+    paths.emplace_back(zkPath::extend_property(node_path, "pid"), Clotho::to_string(::getpid()));
+    return paths;
+}
+
+int zkFrame::restore_nodes(const std::vector<std::string>& node_paths) {
+
+    std::vector<VectorPair> ephemeral_paths{};
+    for (size_t i = 0; i < node_paths.size(); ++i)
+        ephemeral_paths.push_back(ephemeral_node_paths(node_paths[i]));
+
+    int code = -1;
+    std::vector<bool> registered{};
+    for (int retry = 0; retry < kRegisterRetry; ++retry) {
+        code = multi_register(VectorPair(), VectorPair(), ephemeral_paths, false, registered);
+        if (code != ZNODEEXISTS && code != ZNONODE)
+            break;
+    }
+
+    // 当前会话已经持有的active在multi_register中算作注册成功，
+    // 这里失败的是旧会话还没有过期的节点，或者事务本身失败
+    size_t failed = 0;
+    std::lock_guard<std::mutex> lock(lock_);
+    for (size_t i = 0; i < node_paths.size(); ++i) {
+        if (code == 0 && registered[i]) {
+            restore_nodes_.erase(node_paths[i]);
             continue;
         }
 
-        // additional non-critial pid
-        std::string pid_path = zkPath::extend_property(full_node_path, "pid");
-        std::string pid_value = Clotho::to_string(::getpid());
-        if (client_->zk_create(pid_path.c_str(), pid_value, &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL) != 0) {
-            log_err("Create EPHEMERAL pid %s failed.", pid_path.c_str());
+        log_warning("restore node %s failed, code %d, retry later.", node_paths[i].c_str(), code);
+        restore_nodes_.insert(node_paths[i]);
+        ++failed;
+    }
+
+    return failed == 0 ? 0 : -1;
+}
+
+// 不覆盖的时候保留节点上已有的打包属性值，旧格式的节点直接使用新的打包属性
+int zkFrame::merge_packed_properties(const std::string& node_path, std::map<std::string, std::string>& properties) {
+
+    int exist = client_->zk_exists(node_path.c_str(), 0, NULL);
+    if (exist == 0)
+        return 0;
+    else if (exist != 1)
+        return -1;
+
+    std::string value;
+    if (client_->zk_get(node_path.c_str(), value, 0, NULL) != 0)
+        return -1;
+
+    std::map<std::string, std::string> existing;
+    if (!zkPath::unpack_properties(value, existing))
+        return 0;
+
+    for (auto iter = existing.begin(); iter != existing.end(); ++iter)
+        properties[iter->first] = iter->second;
+
+    return 0;
+}
+
+// 先并行检查全部路径是否存在，再把需要的创建和更新操作放到一个zk_multi中原子的提交
+// 订阅者不会看到注册了一半的节点。zk_multi无法表达不存在才创建，所以需要两次往返
+// packed_paths 为打包格式的节点目录，其值已经合并过，存在的时候总是更新
+// ephemeral_paths 每个元素为一个节点的临时路径，第一个是active
+// registered 返回每个节点是否注册成功：active由当前会话持有的也算作成功，
+// 被其他会话持有的节点只跳过其临时路径，持久路径和属性照常创建更新
+int zkFrame::multi_register(const VectorPair& persist_paths, const VectorPair& packed_paths,
+                            const std::vector<VectorPair>& ephemeral_paths, bool overwrite,
+                            std::vector<bool>& registered) {
+
+    registered.assign(ephemeral_paths.size(), false);
+
+    std::vector<std::string> paths{};
+    for (auto iter = persist_paths.begin(); iter != persist_paths.end(); ++iter)
+        paths.push_back(iter->first);
+    for (auto iter = packed_paths.begin(); iter != packed_paths.end(); ++iter)
+        paths.push_back(iter->first);
+    for (size_t i = 0; i < ephemeral_paths.size(); ++i)
+        for (auto iter = ephemeral_paths[i].begin(); iter != ephemeral_paths[i].end(); ++iter)
+            paths.push_back(iter->first);
+
+    std::vector<int> exists{};
+    std::vector<struct Stat> stats{};
+    if (client_->zk_exists_batch(paths, 0, exists, &stats) != 0) {
+        log_err("check exists for register paths failed.");
+        return -1;
+    }
+
+    int64_t session = client_->session_id();
+
+    std::vector<zoo_op_t> ops{};
+    ops.reserve(paths.size());
+
+    for (size_t i = 0; i < persist_paths.size(); ++i) {
+
+        const std::string& path  = persist_paths[i].first;
+        const std::string& value = persist_paths[i].second;
+
+        if (exists[i] == 0) {
+            zoo_op_t op;
+            zoo_create_op_init(&op, path.c_str(), value.c_str(), value.size(), &ZOO_OPEN_ACL_UNSAFE, 0, NULL, 0);
+            ops.push_back(op);
+        } else if (exists[i] == 1) {
+            PathType tp = zkPath::guess_path_type(path);
+            if (overwrite && (tp == PathType::kServiceProperty || tp == PathType::kNodeProperty)) {
+                zoo_op_t op;
+                zoo_set_op_init(&op, path.c_str(), value.c_str(), value.size(), -1, NULL);
+                ops.push_back(op);
+            }
+        } else {
+            log_err("check exists %s failed, code %d", path.c_str(), exists[i]);
+            return exists[i];
         }
+    }
 
-        {
-            // 执行添加操作
-            std::string full = zkPath::make_path(nodes[i].department_, nodes[i].service_, nodes[i].node_);
-            full = zkPath::normalize_path(full);
+    for (size_t i = 0; i < packed_paths.size(); ++i) {
 
-            std::lock_guard<std::mutex> lock(lock_);
-            (*pub_nodes_)[full] = nodes[i];
+        const std::string& path  = packed_paths[i].first;
+        const std::string& value = packed_paths[i].second;
+        int exist = exists[persist_paths.size() + i];
 
-            log_info("successfully add %s into pub_nodes_", full.c_str());
+        zoo_op_t op;
+        if (exist == 0) {
+            zoo_create_op_init(&op, path.c_str(), value.c_str(), value.size(), &ZOO_OPEN_ACL_UNSAFE, 0, NULL, 0);
+        } else if (exist == 1) {
+            zoo_set_op_init(&op, path.c_str(), value.c_str(), value.size(), -1, NULL);
+        } else {
+            log_err("check exists %s failed, code %d", path.c_str(), exist);
+            return exist;
         }
+        ops.push_back(op);
     }
 
-    return 0;
+    size_t offset = persist_paths.size() + packed_paths.size();
+    for (size_t i = 0; i < ephemeral_paths.size(); ++i) {
+
+        const VectorPair& node_paths = ephemeral_paths[i];
+        size_t base = offset;
+        offset += node_paths.size();
+
+        if (node_paths.empty())
+            continue;
+
+        int active = exists[base];
+        if (active != 0 && active != 1) {
+            log_err("check exists %s failed, code %d", node_paths[0].first.c_str(), active);
+            return active;
+        }
+
+        if (active == 1 && stats[base].ephemeralOwner != session) {
+            log_err("Create EPHEMERAL active failed, cirital error: %s owned by session %lld",
+                    node_paths[0].first.c_str(), static_cast<long long>(stats[base].ephemeralOwner));
+            continue;
+        }
+
+        // active不存在，或者已经是当前会话创建的
+        registered[i] = true;
+
+        for (size_t j = 0; j < node_paths.size(); ++j) {
+
+            const std::string& path  = node_paths[j].first;
+            const std::string& value = node_paths[j].second;
+            int exist = exists[base + j];
+
+            if (exist == 1) {
+                if (stats[base + j].ephemeralOwner != session)
+                    log_err("Create EPHEMERAL %s failed, already exists.", path.c_str());
+                continue;
+            } else if (exist != 0) {
+                log_err("check exists %s failed, code %d", path.c_str(), exist);
+                return exist;
+            }
+
+            zoo_op_t op;
+            zoo_create_op_init(&op, path.c_str(), value.c_str(), value.size(), &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL, NULL, 0);
+            ops.push_back(op);
+        }
+    }
+
+    if (ops.empty())
+        return 0;
+
+    std::vector<zoo_op_result_t> results(ops.size());
+    return client_->zk_multi(static_cast<int>(ops.size()), &ops[0], &results[0]);
 }
 
 
@@ -202,62 +552,19 @@ int zkFrame::subscribe_service(const std::string& department, const std::string&
     }
 
     ServiceType srv(department, service);
-
-    std::string value;
-    int code = client_->zk_get(service_path.c_str(), value, 1, NULL);
-    if (code != 0) {
-        log_err("get service %s failed.", service_path.c_str());
-        return -1;
-    }
-
-    srv.properties_["enable"] = value;
-    srv.enabled_ = (value == "1");
     srv.pick_strategy_ = strategy ? strategy : kStrategyDefault;
     srv.with_nodes_ = with_nodes;
 
-    // 处理子节点
-    std::vector<std::string> sub_path{};
-    code = client_->zk_get_children(service_path.c_str(), 1, sub_path);
-    if (code != 0) {
-        log_err("get service children node failed %d", code);
-        return -1;
-    }
-
-    for (size_t i = 0; i < sub_path.size(); ++i) {
-
-        std::string sub_node = service_path + "/" + sub_path[i];
-        PathType tp = zkPath::guess_path_type(sub_node);
-        if (tp == PathType::kServiceProperty) {
-            if (client_->zk_get(sub_node.c_str(), value, 1, NULL) != 0)
-                log_err("get service_property failed: %s", sub_node.c_str());
-            else
-                srv.properties_[sub_path[i]] = value;
-        } else if (tp == PathType::kNode) {
-
-            // 不需要处理子节点
-            if (!srv.with_nodes_)
-                continue;
+    // 持久递归watch需要在读取之前添加，否则可能丢失读取过程中的变更
+    int watch = (add_persistent_watch(service_path) == 0) ? 0 : 1;
 
-            std::string department;
-            std::string service;
-            std::string node_p;
-            if (!NodeType::node_parse(sub_node.c_str(), department, service, node_p)) {
-                log_err("invalid node path: %s, we will ignore this node", sub_node.c_str());
-                continue;
-            }
+    if (fetch_service(service_path, srv, watch) != 0) {
 
-            NodeType node(department, service, node_p);
-            if (internal_subscribe_node(node) != 0) {
-                log_err("subscribe node %s faild!", sub_node.c_str());
-                continue;
-            }
+        if (serve_stale(service_path, srv))
+            return 0;
 
-            log_info("successfully detect and subscribe node %s", sub_node.c_str());
-            srv.nodes_[node_p] = node;
-        } else {
-            // 其他类型节点？
-            log_err("unhandled service sub path: %s", sub_node.c_str());
-        }
+        log_err("get service %s failed.", service_path.c_str());
+        return -1;
     }
 
     {
@@ -266,320 +573,1423 @@ int zkFrame::subscribe_service(const std::string& department, const std::string&
 
         log_info("successfully add/update service %s", service_path.c_str());
         (*sub_services_)[service_path] = srv;
+        publish_service(service_path);
+        service_synced(service_path);
     }
 
     return 0;
 }
 
-// 保留之前的subscribe的策略
-int zkFrame::internal_subscribe_service(const std::string& department, const std::string& service) {
 
-    uint32_t strategy   = kStrategyDefault;
-    bool     with_nodes = false;
+// 删除path以及其子路径的版本信息
+static void erase_versions(std::map<std::string, ZnodeVersion>& versions, const std::string& path) {
 
-    {
-        std::lock_guard<std::mutex> lock(lock_);
-        auto iter = sub_services_->find(zkPath::make_path(department, service));
-        if (iter != sub_services_->end()) {
-            strategy = iter->second.pick_strategy_;
-            with_nodes = iter->second.with_nodes_;
+    auto iter = versions.lower_bound(path);
+    while (iter != versions.end() && iter->first.compare(0, path.size(), path) == 0) {
+        if (iter->first.size() != path.size() && iter->first[path.size()] != '/') {
+            ++iter;
+            continue;
         }
+        iter = versions.erase(iter);
     }
+}
 
-    return subscribe_service(department, service, strategy, with_nodes);
+// 缓存的版本和服务端的Stat是否一致
+static bool version_same(const ZnodeVersion& version, const struct Stat& stat) {
+    return version.mzxid_ == stat.mzxid && version.version_ == stat.version &&
+           (version.cversion_ == -1 || version.cversion_ == stat.cversion);
 }
 
-int zkFrame::internal_subscribe_node(NodeType& node) {
+// 并行获取一个服务的全部信息，所有的get和get_children请求同时在途，
+// 回调中根据子节点列表继续发出下一层的请求，全部回调完成之后fetch返回
+// 对象在栈上构造，ZooKeeper保证每个提交成功的请求都会回调(包括会话关闭)，所以回调中不会访问失效的对象
+class ServiceFetcher {
 
-    std::string node_path = zkPath::make_path(node.department_, node.service_, node.node_);
-    std::string value;
+public:
+    ServiceFetcher(zkClient& client, const std::string& service_path, ServiceType& srv, int watch) :
+        client_(client), service_path_(service_path), srv_(srv), watch_(watch),
+        lock_(), cond_(), pending_(0), code_(0), failed_nodes_(), partial_(false) { }
 
-    if (client_->zk_get(node_path.c_str(), value, 1, NULL) != 0) {
-        log_err("get node %s failed.", node_path.c_str());
-        return -1;
+    int fetch() {
+        start();
+        return wait();
     }
 
-    node.properties_["enable"] = value;
-    node.enabled_ = (value == "1");
+    // 只发出请求不等待，多个服务可以同时在途，之后分别调用wait等待结果
+    void start() {
 
-    if (!zkPath::validate_node(node.node_, node.host_, node.port_)) {
-        log_err("validate nodename failed: %s", node.node_.c_str());
-        return -1;
+        get(service_path_, [this](int rc, const std::string& value, const struct Stat* stat) {
+            on_service_value(rc, value, stat);
+        });
+        get_children(service_path_, [this](int rc, const std::vector<std::string>& children, const struct Stat* stat) {
+            on_service_children(rc, children, stat);
+        });
     }
 
-    std::vector<std::string> sub_path{};
-    int code = client_->zk_get_children(node_path.c_str(), 1, sub_path);
-    if (code != 0) {
-        log_err("get service children node failed %d", code);
-        return -1;
+    // 只获取指定的节点，用于服务成员变更的增量处理
+    int fetch_nodes(const std::vector<std::string>& node_paths) {
+
+        for (size_t i = 0; i < node_paths.size(); ++i)
+            fetch_node(node_paths[i]);
+
+        return wait();
     }
 
-    for (size_t i = 0; i < sub_path.size(); ++i) {
+    int wait() {
 
-        std::string sub_node = node_path + "/" + sub_path[i];
-        PathType tp = zkPath::guess_path_type(sub_node);
-        if (tp == PathType::kNodeProperty) {
-            if (client_->zk_get(sub_node.c_str(), value, 1, NULL) != 0) {
-                log_err("get service_property failed: %s", sub_node.c_str());
-            }
+        std::unique_lock<std::mutex> lock(lock_);
+        cond_.wait(lock, [this] { return pending_ == 0; });
 
-            // 特殊的属性值处理
-            // 这些类型的属性是不会丢到properties_中保存的
-            if (sub_path[i] == "active") {
-                node.active_ = (value == "1" ? true : false);
-            } else if (sub_path[i] == "weight") {
-                int weight = ::atoi(value.c_str());
-                if (weight >= kWPMin && weight <= kWPMax)
-                    node.weight_ = weight;
-            } else if (sub_path[i] == "priority") {
-                int priority = ::atoi(value.c_str());
-                if (priority >= kWPMin && priority <= kWPMax)
-                    node.priority_ = priority;
-            } else if (sub_path[i] == "idc") {
-                if (value != "")
-                    node.idc_ = value;
-            }
+        // 获取失败的节点不加入服务，同时丢弃版本信息，下次周期检查的时候完整刷新
+        for (auto iter = failed_nodes_.begin(); iter != failed_nodes_.end(); ++iter)
+            srv_.nodes_.erase(*iter);
+        if (!failed_nodes_.empty() || partial_)
+            srv_.versions_.clear();
+
+        return code_;
+    }
+
+    // 超时返回ZOPERATIONTIMEOUT，此时请求仍然在途，对象需要保持有效直到全部回调完成
+    int wait_until(const std::chrono::steady_clock::time_point& deadline) {
+
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            if (!cond_.wait_until(lock, deadline, [this] { return pending_ == 0; }))
+                return ZOPERATIONTIMEOUT;
+        }
+
+        return wait();
+    }
+
+    bool finished() {
+        std::lock_guard<std::mutex> lock(lock_);
+        return pending_ == 0;
+    }
+
+private:
+
+    // 提交失败的时候直接以错误码调用回调，保证pending_计数的平衡
+    void get(const std::string& path, const AsyncDataCall& func) {
+        add_pending();
+        int code = client_.zk_aget(path.c_str(), watch_, func);
+        if (code != 0)
+            func(code, std::string(), NULL);
+    }
+
+    void get_children(const std::string& path, const AsyncChildrenCall& func) {
+        add_pending();
+        int code = client_.zk_aget_children(path.c_str(), watch_, func);
+        if (code != 0)
+            func(code, std::vector<std::string>(), NULL);
+    }
+
+    void add_pending() {
+        std::lock_guard<std::mutex> lock(lock_);
+        ++pending_;
+    }
+
+    void done() {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (--pending_ == 0)
+            cond_.notify_all();
+    }
+
+    // 记录znode的版本信息，调用者需要持有lock_
+    // 数据的版本来自get，子节点的版本只来自get_children，两者分别读取可能不是同一个时刻
+    void record(const std::string& path, const struct Stat* stat, bool children) {
+        if (!stat)
+            return;
+
+        ZnodeVersion& version = srv_.versions_[path];
+        if (children) {
+            version.cversion_ = stat->cversion;
+        } else {
+            version.mzxid_ = stat->mzxid;
+            version.version_ = stat->version;
+        }
+    }
+
+    void on_service_value(int rc, const std::string& value, const struct Stat* stat) {
+
+        if (rc != ZOK) {
+            log_err("get service %s failed, ret: %s", service_path_.c_str(), zerror(rc));
+            std::lock_guard<std::mutex> lock(lock_);
+            code_ = -1;
+        } else {
+            std::lock_guard<std::mutex> lock(lock_);
+            srv_.set_value(value);
+            record(service_path_, stat, false);
+        }
+
+        done();
+    }
+
+    void on_service_children(int rc, const std::vector<std::string>& children, const struct Stat* stat) {
+
+        if (rc != ZOK) {
+            log_err("get service children node failed %s, ret: %s", service_path_.c_str(), zerror(rc));
+            std::lock_guard<std::mutex> lock(lock_);
+            code_ = -1;
+            if (--pending_ == 0)
+                cond_.notify_all();
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            record(service_path_, stat, true);
+        }
+
+        for (size_t i = 0; i < children.size(); ++i) {
+
+            std::string sub_node = service_path_ + "/" + children[i];
+            PathType tp = zkPath::guess_path_type(sub_node);
+            if (tp == PathType::kServiceProperty) {
+
+                std::string property = children[i];
+                get(sub_node, [this, property, sub_node](int rc, const std::string& value, const struct Stat* stat) {
+                    if (rc != ZOK) {
+                        log_err("get service_property failed: %s", sub_node.c_str());
+                        std::lock_guard<std::mutex> lock(lock_);
+                        partial_ = true;
+                    } else {
+                        std::lock_guard<std::mutex> lock(lock_);
+                        srv_.properties_[property] = value;
+                        record(sub_node, stat, false);
+                    }
+                    done();
+                });
+
+            } else if (tp == PathType::kNode) {
+
+                // 不需要处理子节点
+                if (!srv_.with_nodes_)
+                    continue;
+
+                fetch_node(sub_node);
+
+            } else {
+                // 其他类型节点？
+                log_err("unhandled service sub path: %s", sub_node.c_str());
+            }
+        }
+
+        done();
+    }
+
+    void fetch_node(const std::string& node_path) {
+
+        std::string department;
+        std::string service;
+        std::string node_p;
+        if (!NodeType::node_parse(node_path.c_str(), department, service, node_p)) {
+            log_err("invalid node path: %s, we will ignore this node", node_path.c_str());
+            return;
+        }
+
+        NodeType node(department, service, node_p);
+        if (!zkPath::validate_node(node.node_, node.host_, node.port_)) {
+            log_err("validate nodename failed: %s", node.node_.c_str());
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            srv_.nodes_[node_p] = node;
+        }
+
+        get(node_path, [this, node_p, node_path](int rc, const std::string& value, const struct Stat* stat) {
+            std::lock_guard<std::mutex> lock(lock_);
+            if (rc != ZOK) {
+                log_err("get node %s failed.", node_path.c_str());
+                failed_nodes_.insert(node_p);
+            } else {
+                srv_.nodes_[node_p].set_value(value);
+                record(node_path, stat, false);
+            }
+            if (--pending_ == 0)
+                cond_.notify_all();
+        });
+
+        get_children(node_path, [this, node_p, node_path](int rc, const std::vector<std::string>& children, const struct Stat* stat) {
+            on_node_children(rc, node_p, node_path, children, stat);
+        });
+    }
+
+    void on_node_children(int rc, const std::string& node_p, const std::string& node_path,
+                          const std::vector<std::string>& children, const struct Stat* stat) {
+
+        if (rc != ZOK) {
+            log_err("get node children failed %s, ret: %s", node_path.c_str(), zerror(rc));
+            std::lock_guard<std::mutex> lock(lock_);
+            failed_nodes_.insert(node_p);
+            if (--pending_ == 0)
+                cond_.notify_all();
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            record(node_path, stat, true);
+        }
+
+        for (size_t i = 0; i < children.size(); ++i) {
+
+            std::string sub_node = node_path + "/" + children[i];
+            if (zkPath::guess_path_type(sub_node) != PathType::kNodeProperty) {
+                log_err("unhandled path: %s", sub_node.c_str());
+                continue;
+            }
+
+            std::string property = children[i];
+            get(sub_node, [this, node_p, property, sub_node](int rc, const std::string& value, const struct Stat* stat) {
+                if (rc != ZOK) {
+                    log_err("get node_property failed: %s", sub_node.c_str());
+                    std::lock_guard<std::mutex> lock(lock_);
+                    partial_ = true;
+                } else {
+                    std::lock_guard<std::mutex> lock(lock_);
+                    srv_.nodes_[node_p].set_property(property, value);
+                    record(sub_node, stat, false);
+                }
+                done();
+            });
+        }
+
+        done();
+    }
+
+    zkClient&           client_;
+    const std::string   service_path_;
+    ServiceType&        srv_;
+    const int           watch_;
+
+    std::mutex              lock_;
+    std::condition_variable cond_;
+    int                     pending_;
+    int                     code_;
+    std::set<std::string>   failed_nodes_;
+    bool                    partial_;   // 有属性读取失败
+};
+
+// 批量订阅中一个服务的获取请求，超时之后由zkFrame::bulk_fetches_持有直到完成
+struct BulkFetch {
+
+    BulkFetch(zkClient& client, const std::string& service_path, const ServiceType& srv, int watch) :
+        service_path_(service_path), srv_(srv), fetcher_(client, service_path_, srv_, watch),
+        persistent_(watch == 0), watch_code_(ZOK), start_version_(0) { }
+
+    const std::string service_path_;
+    ServiceType       srv_;
+    ServiceFetcher    fetcher_;
+
+    // 是否异步添加了持久watch，结果在回调中设置
+    bool              persistent_;
+    std::atomic<int>  watch_code_;
+
+    // 发出请求时服务发布的快照版本，之后有更新的发布则丢弃后台获取的结果
+    uint64_t          start_version_;
+};
+
+// 服务端不支持的时候(ZooKeeper 3.6之前的版本)记录下来，之后都使用一次性watch
+int zkFrame::add_persistent_watch(const std::string& service_path) {
+
+    if (!persistent_watch_supported_)
+        return -1;
+
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (persistent_services_.find(service_path) != persistent_services_.end())
+            return 0;
+    }
+
+    int code = client_->zk_add_persistent_watch(service_path.c_str());
+    if (code != 0) {
+        log_warning("add persistent watch for %s failed, code %d, fallback to one-shot watch.",
+                    service_path.c_str(), code);
+        if (code == ZUNIMPLEMENTED)
+            persistent_watch_supported_ = false;
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(lock_);
+    persistent_services_.insert(service_path);
+    return 0;
+}
+
+bool zkFrame::persistent_watched(const std::string& service_path) {
+    std::lock_guard<std::mutex> lock(lock_);
+    return persistent_services_.find(service_path) != persistent_services_.end();
+}
+
+int zkFrame::settle_bulk_watch(BulkFetch& fetch) {
+
+    if (!fetch.persistent_)
+        return 0;
+
+    int code = fetch.watch_code_;
+    if (code == ZOK) {
+        std::lock_guard<std::mutex> lock(lock_);
+        persistent_services_.insert(fetch.service_path_);
+        return 0;
+    }
+
+    log_warning("add persistent watch for %s failed, code %d, fallback to one-shot watch.",
+                fetch.service_path_.c_str(), code);
+    if (code == ZUNIMPLEMENTED)
+        persistent_watch_supported_ = false;
+
+    // 之前的读取没有设置watch，重新获取一次
+    fetch.persistent_ = false;
+    return fetch_service(fetch.service_path_, fetch.srv_, 1);
+}
+
+bool zkFrame::with_nodes(const std::string& service_path) {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto iter = sub_services_->find(service_path);
+    return iter != sub_services_->end() && iter->second.with_nodes_;
+}
+
+int zkFrame::fetch_service(const std::string& service_path, ServiceType& srv, int watch) {
+
+    // 回调线程阻塞等待会导致completion无法执行
+    if (zkClient::in_callback_thread())
+        return fetch_service_sequential(service_path, srv, watch);
+
+    ServiceFetcher fetcher(*client_, service_path, srv, watch);
+    return fetcher.fetch();
+}
+
+// 获取的节点放到srv.nodes_中，获取失败的节点会被忽略
+int zkFrame::fetch_nodes(const std::string& service_path, const std::vector<std::string>& node_paths,
+                         ServiceType& srv, int watch) {
+
+    if (!zkClient::in_callback_thread()) {
+        ServiceFetcher fetcher(*client_, service_path, srv, watch);
+        return fetcher.fetch_nodes(node_paths);
+    }
+
+    for (size_t i = 0; i < node_paths.size(); ++i) {
+
+        std::string department;
+        std::string service;
+        std::string node_p;
+        if (!NodeType::node_parse(node_paths[i].c_str(), department, service, node_p)) {
+            log_err("invalid node path: %s, we will ignore this node", node_paths[i].c_str());
+            continue;
+        }
+
+        NodeType node(department, service, node_p);
+        if (internal_subscribe_node(node, watch, &srv.versions_) != 0) {
+            log_err("subscribe node %s faild!", node_paths[i].c_str());
+            continue;
+        }
+
+        srv.nodes_[node_p] = node;
+    }
+
+    return 0;
+}
+
+int zkFrame::fetch_service_sequential(const std::string& service_path, ServiceType& srv, int watch) {
+
+    std::string value;
+    struct Stat stat {};
+    int code = client_->zk_get(service_path.c_str(), value, watch, &stat);
+    if (code != 0) {
+        log_err("get service %s failed.", service_path.c_str());
+        return -1;
+    }
+
+    srv.set_value(value);
+    ZnodeVersion& version = srv.versions_[service_path];
+    version.mzxid_ = stat.mzxid;
+    version.version_ = stat.version;
+
+    // 处理子节点
+    std::vector<std::string> sub_path{};
+    code = client_->zk_get_children(service_path.c_str(), watch, sub_path, &stat);
+    if (code != 0) {
+        log_err("get service children node failed %d", code);
+        return -1;
+    }
+
+    version.cversion_ = stat.cversion;
+    bool partial = false;
+
+    for (size_t i = 0; i < sub_path.size(); ++i) {
+
+        std::string sub_node = service_path + "/" + sub_path[i];
+        PathType tp = zkPath::guess_path_type(sub_node);
+        if (tp == PathType::kServiceProperty) {
+            if (client_->zk_get(sub_node.c_str(), value, watch, &stat) != 0) {
+                log_err("get service_property failed: %s", sub_node.c_str());
+                partial = true;
+            } else {
+                srv.properties_[sub_path[i]] = value;
+                srv.versions_[sub_node].mzxid_ = stat.mzxid;
+                srv.versions_[sub_node].version_ = stat.version;
+            }
+        } else if (tp == PathType::kNode) {
+
+            // 不需要处理子节点
+            if (!srv.with_nodes_)
+                continue;
+
+            std::string department;
+            std::string service;
+            std::string node_p;
+            if (!NodeType::node_parse(sub_node.c_str(), department, service, node_p)) {
+                log_err("invalid node path: %s, we will ignore this node", sub_node.c_str());
+                continue;
+            }
+
+            NodeType node(department, service, node_p);
+            if (internal_subscribe_node(node, watch, &srv.versions_) != 0) {
+                log_err("subscribe node %s faild!", sub_node.c_str());
+                partial = true;
+                continue;
+            }
+
+            log_info("successfully detect and subscribe node %s", sub_node.c_str());
+            srv.nodes_[node_p] = node;
+        } else {
+            // 其他类型节点？
+            log_err("unhandled service sub path: %s", sub_node.c_str());
+        }
+    }
+
+    // 和ServiceFetcher一样，有读取失败的时候丢弃版本信息，下次周期检查的时候完整刷新
+    if (partial)
+        srv.versions_.clear();
+
+    return 0;
+}
+
+// 保留之前的subscribe的策略
+int zkFrame::subscribe_service(const std::string& department, const std::string& service,
+                               uint32_t strategy, bool with_nodes, ServiceHandle& handle) {
+
+    int code = subscribe_service(department, service, strategy, with_nodes);
+    if (code != 0)
+        return code;
+
+    auto snapshots = std::atomic_load(&sub_snapshots_);
+    auto iter = snapshots->find(zkPath::make_path(department, service));
+    if (iter == snapshots->end()) {
+        log_err("service /%s/%s subscribed but not published.", department.c_str(), service.c_str());
+        return -1;
+    }
+
+    handle = iter->second;
+    return 0;
+}
+
+int zkFrame::subscribe_services(const std::vector<ServiceSubscription>& subscriptions, uint32_t timeout_ms) {
+
+    // 回调线程中不能等待异步请求，逐个订阅
+    if (zkClient::in_callback_thread()) {
+        int ret = 0;
+        for (size_t i = 0; i < subscriptions.size(); ++i) {
+            if (subscribe_service(subscriptions[i].department_, subscriptions[i].service_,
+                                  subscriptions[i].strategy_, subscriptions[i].with_nodes_) != 0)
+                ret = -1;
+        }
+        return ret;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    int ret = 0;
+
+    std::vector<std::shared_ptr<BulkFetch>> fetches{};
+    for (size_t i = 0; i < subscriptions.size(); ++i) {
+
+        std::string service_path = zkPath::make_path(subscriptions[i].department_, subscriptions[i].service_);
+        if (zkPath::guess_path_type(service_path) != PathType::kService) {
+            log_err("invalid service path: %s", service_path.c_str());
+            ret = -1;
+            continue;
+        }
+
+        ServiceType srv(subscriptions[i].department_, subscriptions[i].service_);
+        srv.pick_strategy_ = subscriptions[i].strategy_ ? subscriptions[i].strategy_ : kStrategyDefault;
+        srv.with_nodes_ = subscriptions[i].with_nodes_;
+
+        fetches.push_back(start_bulk_fetch(service_path, srv));
+    }
+
+    for (size_t i = 0; i < fetches.size(); ++i) {
+
+        const std::string& service_path = fetches[i]->service_path_;
+        int code = timeout_ms ? fetches[i]->fetcher_.wait_until(deadline) : fetches[i]->fetcher_.wait();
+
+        if (code == ZOPERATIONTIMEOUT) {
+            log_warning("subscribe service %s timeout, continue in background.", service_path.c_str());
+
+            // 使用缓存时只是更新了订阅参数，不影响后台获取结果的使用
+            if (serve_stale(service_path, fetches[i]->srv_))
+                fetches[i]->start_version_ = route_version(service_path);
+            else
+                ret = -1;
+
+            std::lock_guard<std::mutex> lock(bulk_lock_);
+            bulk_fetches_.push_back(fetches[i]);
+            continue;
+        }
+
+        if (code != 0 || settle_bulk_watch(*fetches[i]) != 0) {
+            if (serve_stale(service_path, fetches[i]->srv_))
+                continue;
+
+            log_err("get service %s failed.", service_path.c_str());
+            ret = -1;
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(lock_);
+        log_info("successfully add/update service %s", service_path.c_str());
+        (*sub_services_)[service_path] = fetches[i]->srv_;
+        publish_service(service_path);
+        service_synced(service_path);
+    }
+
+    return ret;
+}
+
+bool zkFrame::serve_stale(const std::string& service_path, const ServiceType& srv) {
+
+    if (!stale_)
+        return false;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    auto iter = sub_services_->find(service_path);
+    if (iter == sub_services_->end())
+        return false;
+
+    log_warning("get service %s failed, use stale snapshot.", service_path.c_str());
+    iter->second.pick_strategy_ = srv.pick_strategy_;
+    iter->second.with_nodes_ = srv.with_nodes_;
+    publish_service(service_path);
+    return true;
+}
+
+// 还没有发布是正常的情况，不使用会记录错误日志的find_route
+uint64_t zkFrame::route_version(const std::string& service_path) {
+
+    auto snapshots = std::atomic_load(&sub_snapshots_);
+    auto iter = snapshots->find(service_path);
+    if (iter == snapshots->end())
+        return 0;
+
+    ServiceRoutePtr route = iter->second->route();
+    return route ? route->service().version_ : 0;
+}
+
+// 析构时等待后台批量订阅完成的最长时间
+static const uint32_t kDrainTimeoutMs = 3 * 1000;
+
+std::shared_ptr<BulkFetch> zkFrame::start_bulk_fetch(const std::string& service_path, const ServiceType& srv) {
+
+    // 持久watch和读取一起异步发出，同一个会话的请求按顺序处理，读取之后的变更不会丢失
+    bool persistent = persistent_watched(service_path);
+    bool add_watch = !persistent && persistent_watch_supported_;
+    auto fetch = std::make_shared<BulkFetch>(*client_, service_path, srv,
+                                             (persistent || add_watch) ? 0 : 1);
+    if (add_watch) {
+        std::weak_ptr<BulkFetch> weak = fetch;
+        int code = client_->zk_aadd_persistent_watch(service_path.c_str(), [weak](int rc) {
+            auto ptr = weak.lock();
+            if (ptr)
+                ptr->watch_code_ = rc;
+        });
+        if (code != 0) {
+            if (code == ZUNIMPLEMENTED)
+                persistent_watch_supported_ = false;
+            fetch = std::make_shared<BulkFetch>(*client_, service_path, srv, 1);
+        }
+    }
+
+    fetch->start_version_ = route_version(service_path);
+    fetch->fetcher_.start();
+    return fetch;
+}
+
+void zkFrame::reap_bulk_fetches(bool drain) {
+
+    std::vector<std::shared_ptr<BulkFetch>> finished{};
+    {
+        std::lock_guard<std::mutex> lock(bulk_lock_);
+        for (auto iter = bulk_fetches_.begin(); iter != bulk_fetches_.end(); ) {
+            if (drain || (*iter)->fetcher_.finished()) {
+                finished.push_back(*iter);
+                iter = bulk_fetches_.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(kDrainTimeoutMs);
+    for (size_t i = 0; i < finished.size(); ++i) {
+
+        const std::string& service_path = finished[i]->service_path_;
+        if (drain) {
+            // 回调中仍然会访问这个对象，超时的时候宁可泄漏也不能释放
+            if (finished[i]->fetcher_.wait_until(deadline) == ZOPERATIONTIMEOUT) {
+                log_err("background subscribe of service %s not finished, leak it.", service_path.c_str());
+                new std::shared_ptr<BulkFetch>(finished[i]);
+            }
+            continue;
+        }
+
+        if (finished[i]->fetcher_.wait() != 0 || settle_bulk_watch(*finished[i]) != 0) {
+            log_err("drop background subscribe of service %s", service_path.c_str());
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(lock_);
+        if (route_version(service_path) != finished[i]->start_version_) {
+            log_warning("service %s updated since background subscribe started, drop the result.",
+                        service_path.c_str());
+            continue;
+        }
+
+        log_info("successfully add/update service %s in background", service_path.c_str());
+        (*sub_services_)[service_path] = finished[i]->srv_;
+        publish_service(service_path);
+        service_synced(service_path);
+    }
+}
+
+int zkFrame::load_manifest(const std::string& file, std::vector<ServiceSubscription>& subscriptions) {
+
+    std::ifstream ifs(file.c_str());
+    if (!ifs.is_open()) {
+        log_err("open manifest file %s failed.", file.c_str());
+        return -1;
+    }
+
+    std::vector<ServiceSubscription> loaded{};
+    std::string line;
+    size_t line_no = 0;
+
+    while (std::getline(ifs, line)) {
+
+        ++line_no;
+        std::istringstream iss(line);
+
+        std::string department;
+        if (!(iss >> department) || department[0] == '#')
+            continue;
+
+        std::string service;
+        std::string strategy;
+        std::string with_nodes;
+        if (!(iss >> service)) {
+            log_err("invalid manifest line %d: %s", static_cast<int>(line_no), line.c_str());
+            return -1;
+        }
+
+        ServiceSubscription subscription(department, service);
+        if (iss >> strategy)
+            subscription.strategy_ = static_cast<uint32_t>(::strtoul(strategy.c_str(), NULL, 0));
+        if (iss >> with_nodes)
+            subscription.with_nodes_ = (with_nodes != "0");
+
+        if (zkPath::guess_path_type(zkPath::make_path(department, service)) != PathType::kService) {
+            log_err("invalid service in manifest line %d: %s", static_cast<int>(line_no), line.c_str());
+            return -1;
+        }
+
+        loaded.push_back(subscription);
+    }
+
+    subscriptions.swap(loaded);
+    return 0;
+}
+
+int zkFrame::internal_subscribe_service(const std::string& department, const std::string& service) {
+
+    uint32_t strategy   = kStrategyDefault;
+    bool     with_nodes = false;
+
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto iter = sub_services_->find(zkPath::make_path(department, service));
+        if (iter != sub_services_->end()) {
+            strategy = iter->second.pick_strategy_;
+            with_nodes = iter->second.with_nodes_;
+        }
+    }
+
+    return subscribe_service(department, service, strategy, with_nodes);
+}
+
+int zkFrame::internal_subscribe_node(NodeType& node, int watch, std::map<std::string, ZnodeVersion>* versions) {
+
+    std::string node_path = zkPath::make_path(node.department_, node.service_, node.node_);
+    std::string value;
+    struct Stat stat {};
+
+    if (client_->zk_get(node_path.c_str(), value, watch, &stat) != 0) {
+        log_err("get node %s failed.", node_path.c_str());
+        return -1;
+    }
+
+    std::map<std::string, ZnodeVersion> fetched{};
+    ZnodeVersion& version = fetched[node_path];
+    version.mzxid_ = stat.mzxid;
+    version.version_ = stat.version;
+
+    node.set_value(value);
+
+    if (!zkPath::validate_node(node.node_, node.host_, node.port_)) {
+        log_err("validate nodename failed: %s", node.node_.c_str());
+        return -1;
+    }
+
+    std::vector<std::string> sub_path{};
+    int code = client_->zk_get_children(node_path.c_str(), watch, sub_path, &stat);
+    if (code != 0) {
+        log_err("get service children node failed %d", code);
+        return -1;
+    }
+
+    version.cversion_ = stat.cversion;
+    bool partial = false;
+
+    for (size_t i = 0; i < sub_path.size(); ++i) {
+
+        std::string sub_node = node_path + "/" + sub_path[i];
+        PathType tp = zkPath::guess_path_type(sub_node);
+        if (tp == PathType::kNodeProperty) {
+            if (client_->zk_get(sub_node.c_str(), value, watch, &stat) != 0) {
+                log_err("get service_property failed: %s", sub_node.c_str());
+                partial = true;
+                continue;
+            }
+
+            node.set_property(sub_path[i], value);
+            fetched[sub_node].mzxid_ = stat.mzxid;
+            fetched[sub_node].version_ = stat.version;
+
+        } else {
+            log_err("unhandled path: %s", sub_node.c_str());
+        }
+    }
+
+    // 属性不完整的时候节点本身不记录版本，下次周期检查的时候重新读取
+    if (partial)
+        fetched[node_path] = ZnodeVersion();
+
+    if (versions) {
+        erase_versions(*versions, node_path);
+        versions->insert(fetched.begin(), fetched.end());
+    }
+
+    return 0;
+}
+
+
+int zkFrame::internal_subscribe_node(const char* node_path) {
+
+    if (!node_path || strlen(node_path) == 0)
+        return -1;
+
+    std::string department;
+    std::string service;
+    std::string node_p;
+    if (!NodeType::node_parse(node_path, department, service, node_p)) {
+        log_err("invalid node path: %s, we will ignore this node", node_path);
+        return -1;
+    }
+
+    NodeType node(department, service, node_p);
+    std::map<std::string, ZnodeVersion> versions{};
+    int watch = persistent_watched(zkPath::make_path(department, service)) ? 0 : 1;
+    if (internal_subscribe_node(node, watch, &versions) != 0) {
+        log_err("subscribe node %s faild!", node_path);
+        return -1;
+    }
+
+    log_info("successfully detected node %s", node_path);
+
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        std::string service_path = zkPath::make_path(department, service);
+        auto iter = sub_services_->find(service_path);
+        if (iter != sub_services_->end()) {
+            iter->second.nodes_[node_p] = node;
+            // 没有版本信息的服务等待完整刷新，这里不能只记录一个节点
+            if (!iter->second.versions_.empty()) {
+                erase_versions(iter->second.versions_, zkPath::make_path(department, service, node_p));
+                iter->second.versions_.insert(versions.begin(), versions.end());
+            }
+            publish_service(service_path);
+            log_info("node %s register successfully.", node_path);
+        } else {
+            log_err("service %s not found, not subsubscribed??", service.c_str());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+ServiceRoutePtr zkFrame::find_route(const std::string& service_path) {
+
+    auto snapshots = std::atomic_load(&sub_snapshots_);
+    auto iter = snapshots->find(service_path);
+    if (iter != snapshots->end()) {
+        ServiceRoutePtr route = iter->second->route();
+        if (route)
+            return route;
+    }
+
+    log_err("can not find %s in sub_service!", service_path.c_str());
+    return ServiceRoutePtr();
+}
+
+int zkFrame::pick_service_node(const std::string& department, const std::string& service,
+                               NodeType& node) {
+
+    // 持有快照的引用计数，在本次选择过程中快照内容不会被修改和释放
+    ServiceRoutePtr route = find_route(zkPath::make_path(department, service));
+    if (!route)
+        return -1;
+
+    int index = route->pick(route->service().pick_strategy_);
+    if (index < 0)
+        return -1;
+
+    node = route->node(index);
+    return 0;
+}
+
+int zkFrame::pick_service_node(const std::string& department, const std::string& service,
+                               const std::string& key, NodeType& node) {
+
+    ServiceRoutePtr route = find_route(zkPath::make_path(department, service));
+    if (!route)
+        return -1;
+
+    // 保留订阅时候的IDC等策略，附加一致性哈希
+    int index = route->pick(route->service().pick_strategy_ | kStrategyConsistentHash, key);
+    if (index < 0)
+        return -1;
+
+    node = route->node(index);
+    return 0;
+}
+
+int zkFrame::pick_service_node(const std::string& department, const std::string& service,
+                               uint32_t strategy, NodeType& node) {
+
+    std::string service_path = zkPath::make_path(department, service);
+    if (zkPath::guess_path_type(service_path) != PathType::kService || strategy == 0) {
+        log_err("pick service arguments error: %s, %d", service_path.c_str(), strategy);
+        return -1;
+    }
+
+    ServiceRoutePtr route = find_route(service_path);
+    if (!route)
+        return -1;
+
+    int index = route->pick(strategy);
+    if (index < 0)
+        return -1;
+
+    node = route->node(index);
+    return 0;
+}
+
+int zkFrame::pick(const ServiceHandle& handle, NodeType& node) {
+
+    ServiceRoutePtr route = handle ? handle->route() : ServiceRoutePtr();
+    if (!route) {
+        log_err("service handle %s not available.", handle ? handle->service_path().c_str() : "NULL");
+        return -1;
+    }
+
+    int index = route->pick(route->service().pick_strategy_);
+    if (index < 0)
+        return -1;
+
+    node = route->node(index);
+    return 0;
+}
+
+int zkFrame::pick(const ServiceHandle& handle, uint32_t strategy, NodeType& node) {
+
+    ServiceRoutePtr route = handle ? handle->route() : ServiceRoutePtr();
+    if (!route || strategy == 0) {
+        log_err("service handle %s not available, or strategy %d invalid.",
+                handle ? handle->service_path().c_str() : "NULL", strategy);
+        return -1;
+    }
+
+    int index = route->pick(strategy);
+    if (index < 0)
+        return -1;
+
+    node = route->node(index);
+    return 0;
+}
+
+int zkFrame::pick(const ServiceHandle& handle, const std::string& key, NodeType& node) {
+
+    ServiceRoutePtr route = handle ? handle->route() : ServiceRoutePtr();
+    if (!route) {
+        log_err("service handle %s not available.", handle ? handle->service_path().c_str() : "NULL");
+        return -1;
+    }
+
+    int index = route->pick(route->service().pick_strategy_ | kStrategyConsistentHash, key);
+    if (index < 0)
+        return -1;
+
+    node = route->node(index);
+    return 0;
+}
+
+// 别名构造的node_和route共享引用计数，只是原子的增加计数
+static inline void fill_endpoint(const ServiceRoutePtr& route, int index, Endpoint& endpoint) {
+    endpoint = route->endpoint(index);
+    endpoint.node_ = std::shared_ptr<const NodeType>(route, &route->node(index));
+}
+
+int zkFrame::pick(const ServiceHandle& handle, Endpoint& endpoint) {
+
+    ServiceRoutePtr route = handle ? handle->route() : ServiceRoutePtr();
+    if (!route) {
+        log_err("service handle %s not available.", handle ? handle->service_path().c_str() : "NULL");
+        return -1;
+    }
+
+    int index = route->pick(route->service().pick_strategy_);
+    if (index < 0)
+        return -1;
+
+    fill_endpoint(route, index, endpoint);
+    return 0;
+}
+
+int zkFrame::pick(const ServiceHandle& handle, uint32_t strategy, Endpoint& endpoint) {
+
+    ServiceRoutePtr route = handle ? handle->route() : ServiceRoutePtr();
+    if (!route || strategy == 0) {
+        log_err("service handle %s not available, or strategy %d invalid.",
+                handle ? handle->service_path().c_str() : "NULL", strategy);
+        return -1;
+    }
+
+    int index = route->pick(strategy);
+    if (index < 0)
+        return -1;
+
+    fill_endpoint(route, index, endpoint);
+    return 0;
+}
+
+int zkFrame::pick(const ServiceHandle& handle, const std::string& key, Endpoint& endpoint) {
+
+    ServiceRoutePtr route = handle ? handle->route() : ServiceRoutePtr();
+    if (!route) {
+        log_err("service handle %s not available.", handle ? handle->service_path().c_str() : "NULL");
+        return -1;
+    }
+
+    int index = route->pick(route->service().pick_strategy_ | kStrategyConsistentHash, key);
+    if (index < 0)
+        return -1;
+
+    fill_endpoint(route, index, endpoint);
+    return 0;
+}
+
+int zkFrame::pick_service_nodes(const std::string& department, const std::string& service,
+                                uint32_t strategy, size_t count, std::vector<NodeType>& nodes,
+                                const std::set<std::string>& exclude) {
+
+    std::string service_path = zkPath::make_path(department, service);
+    if (zkPath::guess_path_type(service_path) != PathType::kService || strategy == 0) {
+        log_err("pick service arguments error: %s, %d", service_path.c_str(), strategy);
+        return -1;
+    }
+
+    ServiceRoutePtr route = find_route(service_path);
+    if (!route)
+        return -1;
 
-            // all will be recorded in properties_
-            node.properties_[sub_path[i]] = value;
+    std::vector<uint32_t> index;
+    if (route->pick_multi(strategy, count, exclude, index) != 0)
+        return -1;
 
-        } else {
-            log_err("unhandled path: %s", sub_node.c_str());
-        }
-    }
+    nodes.clear();
+    nodes.reserve(index.size());
+    for (size_t i = 0; i < index.size(); ++i)
+        nodes.push_back(route->node(index[i]));
 
     return 0;
 }
 
+// route持有负载统计的引用计数，返回的指针在route释放之前有效
+NodeLoad* zkFrame::find_node_load(const NodeType& node, ServiceRoutePtr& route) {
 
-int zkFrame::internal_subscribe_node(const char* node_path) {
+    route = find_route(zkPath::make_path(node.department_, node.service_));
+    if (!route)
+        return NULL;
 
-    if (!node_path || strlen(node_path) == 0)
-        return -1;
+    NodeLoad* load = route->find_load(node.node_);
+    if (!load) {
+        log_err("can not find node %s in /%s/%s",
+                node.node_.c_str(), node.department_.c_str(), node.service_.c_str());
+    }
 
-    std::string department;
-    std::string service;
-    std::string node_p;
-    if (!NodeType::node_parse(node_path, department, service, node_p)) {
-        log_err("invalid node path: %s, we will ignore this node", node_path);
+    return load;
+}
+
+int zkFrame::begin_call(const NodeType& node) {
+
+    ServiceRoutePtr route;
+    NodeLoad* load = find_node_load(node, route);
+    if (!load)
         return -1;
-    }
 
-    NodeType node(department, service, node_p);
-    if (internal_subscribe_node(node) != 0) {
-        log_err("subscribe node %s faild!", node_path);
+    load->begin_call();
+    return 0;
+}
+
+int zkFrame::end_call(const NodeType& node, uint32_t latency_us, bool success) {
+
+    ServiceRoutePtr route;
+    NodeLoad* load = find_node_load(node, route);
+    if (!load)
         return -1;
-    }
 
-    log_info("successfully detected node %s", node_path);
+    load->end_call();
+    load->report_call(latency_us, success);
+    return 0;
+}
 
-    {
-        std::lock_guard<std::mutex> lock(lock_);
-        std::string service_path = zkPath::make_path(department, service);
-        auto iter = sub_services_->find(service_path);
-        if (iter != sub_services_->end()) {
-            iter->second.nodes_[node_p] = node;
-            log_info("node %s register successfully.", node_path);
-        } else {
-            log_err("service %s not found, not subsubscribed??", service.c_str());
-            return -1;
-        }
-    }
+int zkFrame::report_call(const NodeType& node, uint32_t latency_us, bool success) {
+
+    ServiceRoutePtr route;
+    NodeLoad* load = find_node_load(node, route);
+    if (!load)
+        return -1;
 
+    load->report_call(latency_us, success);
     return 0;
 }
 
 
-int zkFrame::pick_service_node(const std::string& department, const std::string& service,
-                               NodeType& node) {
+// 只重新构造发生变更的服务快照和路由索引，其他服务不受影响
+// 服务被删除的时候保留其槽位，已经发放的句柄在服务重新上线之后继续有效
+void zkFrame::publish_service(const std::string& service_path) {
 
-    uint32_t strategy = 0;
-    std::string service_path = zkPath::make_path(department, service);
+    auto snapshots = std::atomic_load(&sub_snapshots_);
 
-    {
-        std::lock_guard<std::mutex> lock(lock_);
-        auto iter = sub_services_->find(service_path);
-        if (iter == sub_services_->end()) {
-            log_err("can not find %s in sub_service!", service_path.c_str());
-            return -1;
-        }
+    ServiceHandle slot;
+    auto found = snapshots->find(service_path);
+    if (found != snapshots->end())
+        slot = found->second;
+
+    auto iter = sub_services_->find(service_path);
+    if (iter == sub_services_->end()) {
+        if (slot)
+            slot->set_route(ServiceRoutePtr());
+        return;
+    }
+
+    ServiceType srv = iter->second;
+    srv.version_ = ++snapshot_version_;
 
-        strategy = iter->second.pick_strategy_;
+    if (slot) {
+        // 上一个版本的路由索引用于增量构造一致性哈希环
+        ServiceRoutePtr previous = slot->route();
+        slot->set_route(std::make_shared<ServiceRoute>(std::move(srv), idc_, previous.get()));
+        return;
     }
 
-    return pick_service_node(department, service, strategy, node);
+    // 新增的服务，写时复制整个槽位表
+    slot = std::make_shared<ServiceSlot>(service_path);
+    slot->set_route(std::make_shared<ServiceRoute>(std::move(srv), idc_));
+
+    auto updated = std::make_shared<MapServiceSlot>(*snapshots);
+    (*updated)[service_path] = slot;
+    std::atomic_store(&sub_snapshots_, std::shared_ptr<const MapServiceSlot>(updated));
 }
 
-// 降序方式排列优先级
-static inline int sort_node_by_priority(const NodeType& n1, const NodeType& n2) {
-    return (n1.priority_ > n2.priority_);
+void zkFrame::service_synced(const std::string& service_path) {
+
+    if (!stale_ || stale_services_.erase(service_path) == 0 || !stale_services_.empty())
+        return;
+
+    log_info("services loaded from snapshot are synchronized.");
+    stale_ = false;
 }
 
-int zkFrame::pick_service_node(const std::string& department, const std::string& service,
-                               uint32_t strategy, NodeType& node) {
 
-    static uint32_t CHOOSE_INDEX = 0;
+// 先批量检查缓存的全部znode的版本，只重新读取发生变化的部分：
+// 服务目录或者服务属性的值变化刷新整个服务，只有cversion变化(节点和属性的增删)则增量对比子节点，
+// 节点及其属性变化只读取这些节点，这样watch没有重新设置成功的时候也能够修复
+// 没有版本信息的服务(比如从快照加载或者读取不完整的)总是完整刷新
+int zkFrame::periodicly_care() {
 
-    std::string service_path = zkPath::make_path(department, service);
-    if (zkPath::guess_path_type(service_path) != PathType::kService || strategy == 0) {
-        log_err("pick service arguments error: %s, %d", service_path.c_str(), strategy);
+    // 会话重建期间的请求都会失败，保留现有的缓存等待重连完成
+    if (!connected()) {
+        log_warning("ZooKeeper not connected: %s, skip refresh.",
+                    zkClient::conn_state_str(connection_state()));
         return -1;
     }
 
-    ServiceType service_instance{};
+    reap_bulk_fetches(false);
 
+    // 重试会话重建时没有恢复的节点，已经撤销发布的节点不再恢复
+    std::vector<std::string> restore_paths{};
     {
         std::lock_guard<std::mutex> lock(lock_);
-        auto iter = sub_services_->find(service_path);
-        if (iter == sub_services_->end()) {
-            log_err("can not find %s in sub_service!", service_path.c_str());
-            return -1;
+        for (auto iter = restore_nodes_.begin(); iter != restore_nodes_.end(); ) {
+            if (pub_nodes_->find(*iter) == pub_nodes_->end()) {
+                iter = restore_nodes_.erase(iter);
+                continue;
+            }
+            restore_paths.push_back(*iter);
+            ++iter;
         }
-
-        // 首先拷贝，后续考虑优化，尤其对于这种读多写少的数据
-        service_instance = iter->second; // copy
     }
 
-    std::vector<NodeType> before{};
-    std::vector<NodeType> filtered{};
+    if (!restore_paths.empty() && restore_nodes(restore_paths) == 0)
+        log_info("restore %d ephemeral nodes successfully.", static_cast<int>(restore_paths.size()));
+
+    std::vector<std::string> full_services{};
+    std::vector<std::string> service_paths{};
 
-    // Step0. 选取所有可用节点
-    for (auto iter = service_instance.nodes_.begin();
-         iter != service_instance.nodes_.end();
-         ++iter) {
-        if (iter->second.available())
-            before.emplace_back(iter->second);
+    std::vector<std::string>  paths{};
+    std::vector<ZnodeVersion> versions{};
+    std::vector<size_t>       owners{};     // paths[i]所属服务在service_paths中的下标
+
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        for (auto iter = sub_services_->begin(); iter != sub_services_->end(); ++iter) {
+
+            if (iter->second.versions_.empty()) {
+                full_services.push_back(iter->first);
+                continue;
+            }
+
+            size_t owner = service_paths.size();
+            service_paths.push_back(iter->first);
+            for (auto version = iter->second.versions_.begin(); version != iter->second.versions_.end(); ++version) {
+                paths.push_back(version->first);
+                versions.push_back(version->second);
+                owners.push_back(owner);
+            }
+        }
     }
 
-    if (before.empty()) {
-        log_err("not any available nodes for service %s with avaiable check.", service_path.c_str());
+    std::vector<int> exists{};
+    std::vector<struct Stat> stats{};
+    if (!paths.empty() && client_->zk_exists_batch(paths, 0, exists, &stats) != 0) {
+        log_err("check versions of cached znodes failed.");
         return -1;
     }
 
+    // 服务目录的值变化需要完整刷新，只有cversion变化的是成员变更，增量处理
+    std::vector<bool> service_changed(service_paths.size(), false);
+    std::vector<bool> children_changed(service_paths.size(), false);
+    std::vector<std::set<std::string>> node_changed(service_paths.size());
 
-    // Step1. 如果有kStragetyMaster，则选择Master节点；失败就返回
-    if (strategy & kStrategyMaster) {
-        auto iter = service_instance.properties_.find("lock_master");
-        if (iter != service_instance.properties_.end()) {
-
-            std::string str_node_pid = iter->second;
+    for (size_t i = 0; i < paths.size(); ++i) {
 
-            // 设计原因，lock节点存储的是ip-pid的数据来标识锁的隶属的，我们无法保证存储节点信息，因为
-            // 非注册的节点也可以尝试获取分布式锁
-            // 这里根据每个节点properties的pid属性来进行尝试匹配
-            for (size_t i = 0; i < before.size(); ++i) {
-                if (before[i].properties_.find("pid") == before[i].properties_.end())
-                    continue;
-                std::string expect = before[i].host_ + "-" + before[i].properties_["pid"];
-                if (expect == str_node_pid) {
-                    node = before[i];
-                    return 0;
-                }
-            }
+        if (exists[i] == 1 && version_same(versions[i], stats[i]))
+            continue;
 
-            log_err("available master node %s not found", str_node_pid.c_str());
-            return -1;
+        std::string department;
+        std::string service;
+        std::string node_p;
+        std::string property;
+
+        PathType tp = zkPath::guess_path_type(paths[i]);
+        if (tp == PathType::kNode) {
+            node_changed[owners[i]].insert(paths[i]);
+        } else if (tp == PathType::kNodeProperty &&
+                   NodeType::node_property_parse(paths[i].c_str(), department, service, node_p, property)) {
+            node_changed[owners[i]].insert(zkPath::make_path(department, service, node_p));
+        } else if (tp == PathType::kServiceProperty && exists[i] != 1) {
+            // 属性的删除同时改变服务目录的cversion，增量对比的时候处理
+            children_changed[owners[i]] = true;
+        } else if (tp == PathType::kService && exists[i] == 1 &&
+                   versions[i].mzxid_ == stats[i].mzxid && versions[i].version_ == stats[i].version) {
+            children_changed[owners[i]] = true;
+        } else {
+            service_changed[owners[i]] = true;
         }
-
-        log_err("lock_master not found for service /%s/%s", department.c_str(), service.c_str());
-        return -1;
     }
 
+    for (size_t i = 0; i < service_paths.size(); ++i) {
 
-    // Step2. 根据IDC进行候选解点的筛选
-    filtered.clear();
-    if (strategy & kStrategyIdc) {
-        for (size_t i = 0; i < before.size(); ++i) {
-            if (before[i].idc_ == idc_)
-                filtered.emplace_back(before[i]);
+        if (service_changed[i]) {
+            full_services.push_back(service_paths[i]);
+            continue;
         }
 
-        // 如果只得到一个可用节点，就直接返回这个节点
-        if (filtered.size() == 1) {
-            node = filtered[0];
-            return 0;
+        std::string department;
+        std::string service;
+        if (children_changed[i] && ServiceType::service_parse(service_paths[i].c_str(), department, service)) {
+            log_info("children of service %s changed, diff them.", service_paths[i].c_str());
+            internal_diff_service_children(department, service);
+
+            // 被删除的节点已经在diff中处理
+            std::lock_guard<std::mutex> lock(lock_);
+            auto iter = sub_services_->find(service_paths[i]);
+            for (auto node = node_changed[i].begin(); node != node_changed[i].end(); ) {
+                if (iter == sub_services_->end() || iter->second.versions_.find(*node) == iter->second.versions_.end())
+                    node = node_changed[i].erase(node);
+                else
+                    ++node;
+            }
         }
 
-        // 如果IDC筛选后可用节点为空，则取消IDC筛选条件
-        if (filtered.empty()) {
-            log_warning("filtered by kStrategyIdc remains empty nodes, reset IDC strict.");
-        } else {
-            before = filtered;
+        if (!node_changed[i].empty()) {
+            log_info("refresh %d changed nodes of service %s",
+                     static_cast<int>(node_changed[i].size()), service_paths[i].c_str());
+            refresh_service_nodes(service_paths[i], node_changed[i]);
         }
     }
 
-    // Step3. 随机选择可用节点
-    if (strategy & kStrategyRandom) {
-        uint32_t rands = static_cast<uint32_t>(::random());
-        node = before[rands % before.size()];
-        log_info("by kStrategyRandom, return %s",
-                  zkPath::make_path(node.department_, node.service_, node.node_).c_str());
-        return 0;
+    for (size_t i = 0; i < full_services.size(); ++i) {
+        std::string depart;
+        std::string service;
+        if (ServiceType::service_parse(full_services[i].c_str(), depart, service))
+            internal_subscribe_service(depart, service);
     }
 
-    // Step4. Round-Robin方式轮询
-    if (strategy & kStrategyRoundRobin) {
-        if (++CHOOSE_INDEX > 0xFFFF)
-            CHOOSE_INDEX = 0;
-        node = before[CHOOSE_INDEX % before.size()];
-        log_info("by kStrategyRoundRoubin, return %s",
-                  zkPath::make_path(node.department_, node.service_, node.node_).c_str());
-        return 0;
-    }
+    if (!snapshot_file_.empty()) {
+        MapServiceType services{};
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            services = *sub_services_;
+        }
 
-    // Step5. 默认的，根据优先级和权重的方式筛选
-    filtered.clear();
-    if (strategy & kStrategyWP) {
-        std::sort(before.begin(), before.end(), sort_node_by_priority);
+        if (zkSnapshot::dump(snapshot_file_, services) != 0)
+            log_err("dump snapshot to %s failed.", snapshot_file_.c_str());
     }
 
-    uint32_t top_priority = before[0].priority_;
-    uint32_t total_weight = 0;
-    std::vector<uint32_t> weight_ladder;
+    return 0;
+}
 
-    for (size_t i = 0; i < before.size(); ++i) {
-        if (before[i].priority_ < top_priority)
-            break;
+int zkFrame::refresh_service_nodes(const std::string& service_path, const std::set<std::string>& node_paths) {
 
-        total_weight += before[i].weight_;
-        weight_ladder.push_back(total_weight);
+    std::string department;
+    std::string service;
+    if (!ServiceType::service_parse(service_path.c_str(), department, service)) {
+        log_err("invalid service path: %s", service_path.c_str());
+        return -1;
     }
 
-    uint32_t rand_w = static_cast<uint32_t>(::random() % total_weight);
-    for (size_t i = 0; i < weight_ladder.size(); ++i) {
-        if (rand_w <= weight_ladder[i]) {
-            node = before[i];
-            log_info("filter by priority and weight, return %s",
-                      zkPath::make_path(node.department_, node.service_, node.node_).c_str());
-            return 0;
-        }
+    ServiceType fetched(department, service);
+    std::vector<std::string> paths(node_paths.begin(), node_paths.end());
+    int watch = persistent_watched(service_path) ? 0 : 1;
+    fetch_nodes(service_path, paths, fetched, watch);
+
+    std::lock_guard<std::mutex> lock(lock_);
+    auto iter = sub_services_->find(service_path);
+    if (iter == sub_services_->end()) {
+        log_err("service %s removed during update.", service_path.c_str());
+        return -1;
     }
 
-    log_err("no available node, or your algorithm's problem.");
-    return -1;
-}
+    ServiceType& srv = iter->second;
+    bool failed = false;
+    for (size_t i = 0; i < paths.size(); ++i) {
 
+        std::string node_p = paths[i].substr(service_path.size() + 1);
+        erase_versions(srv.versions_, paths[i]);
 
-int zkFrame::periodicly_care() {
+        auto node = fetched.nodes_.find(node_p);
+        if (node == fetched.nodes_.end()) {
+            // 节点被删除的时候服务目录的cversion也会变化，这里是读取失败，下次完整刷新
+            log_err("refresh node %s failed.", paths[i].c_str());
+            srv.nodes_.erase(node_p);
+            failed = true;
+            continue;
+        }
+
+        srv.nodes_[node_p] = node->second;
+    }
+
+    if (failed) {
+        srv.versions_.clear();
+    } else {
+        for (auto version = fetched.versions_.begin(); version != fetched.versions_.end(); ++version)
+            srv.versions_[version->first] = version->second;
+    }
+
+    publish_service(service_path);
+    return 0;
+}
 
-    std::vector<std::string> services{};
+// 会话过期之后临时节点和全部的watch都丢失了，会话重建之后批量恢复：
+// 发布节点的active和pid放到一个事务中重新创建，订阅的服务同时发出读取请求并重新设置watch
+int zkFrame::internal_session_renewed() {
 
+    MapNodeType reg_nodes{};
+    std::vector<ServiceType> srvs{};
     {
         std::lock_guard<std::mutex> lock(lock_);
-        for (auto iter = sub_services_->begin(); iter != sub_services_->end(); ++iter)
-            services.push_back(iter->first);
+        reg_nodes = *pub_nodes_;
+
+        for (auto iter = sub_services_->begin(); iter != sub_services_->end(); ++iter) {
+            ServiceType srv(iter->second.department_, iter->second.service_);
+            srv.pick_strategy_ = iter->second.pick_strategy_;
+            srv.with_nodes_ = iter->second.with_nodes_;
+            srvs.push_back(srv);
+        }
+
+        // 持久递归watch也是会话级别的，需要重新添加
+        persistent_services_.clear();
     }
 
-    for (size_t i = 0; i < services.size(); ++i) {
-        std::string depart;
-        std::string service;
-        if (ServiceType::service_parse(services[i].c_str(), depart, service))
-            internal_subscribe_service(depart, service);
+    log_info("session renewed, restore %d nodes and %d services.",
+             static_cast<int>(reg_nodes.size()), static_cast<int>(srvs.size()));
+
+    int ret = 0;
+
+    std::vector<std::string> node_paths{};
+    for (auto iter = reg_nodes.begin(); iter != reg_nodes.end(); ++iter)
+        node_paths.push_back(iter->first);
+
+    if (!node_paths.empty() && restore_nodes(node_paths) != 0) {
+        log_err("restore ephemeral nodes failed, retry in periodicly_care.");
+        ret = -1;
     }
 
-    return 0;
-}
+    // 和subscribe_services一样，持久watch和读取一次全部异步发出
+    std::vector<std::shared_ptr<BulkFetch>> fetches{};
+    for (size_t i = 0; i < srvs.size(); ++i)
+        fetches.push_back(start_bulk_fetch(zkPath::make_path(srvs[i].department_, srvs[i].service_), srvs[i]));
 
+    for (size_t i = 0; i < fetches.size(); ++i) {
+
+        // 获取失败的服务保留原有的缓存，等待periodicly_care再次刷新
+        const std::string& service_path = fetches[i]->service_path_;
+        if (fetches[i]->fetcher_.wait() != 0 || settle_bulk_watch(*fetches[i]) != 0) {
+            log_err("restore service %s failed.", service_path.c_str());
+            ret = -1;
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(lock_);
+        (*sub_services_)[service_path] = fetches[i]->srv_;
+        publish_service(service_path);
+        service_synced(service_path);
+    }
+
+    return ret;
+}
 
 
 int zkFrame::set_priority(NodeType& node, uint16_t priority) {
@@ -744,7 +2154,9 @@ static inline std::string base_path(const std::string& path) {
 
 int zkFrame::handle_zk_event(int type, int state, const char* path) {
 
-    assert(type != ZOO_SESSION_EVENT);
+    // zkClient在会话重建之后投递的通知
+    if (type == ZOO_SESSION_EVENT)
+        return internal_session_renewed();
 
     if (!path || strlen(path) == 0) {
         log_err("can not handle with empty path, info: %d, %d", type, state);
@@ -800,6 +2212,13 @@ int zkFrame::handle_zk_event(int type, int state, const char* path) {
                        (type == ZOO_CHANGED_EVENT ||
                         type == ZOO_NOTWATCHING_EVENT)) {
                 cb_node_path = base_path(path);
+            } else if (type == ZOO_CREATED_EVENT || type == ZOO_DELETED_EVENT) {
+                // 持久递归watch模式下属性和节点的增删没有ZOO_CHILD_EVENT
+                if (tp == PathType::kNodeProperty && persistent_watched(base_path(base_path(path))))
+                    cb_node_path = base_path(path);
+                else if ((tp == PathType::kServiceProperty || tp == PathType::kNode) &&
+                         persistent_watched(base_path(path)))
+                    cb_serv_path = base_path(path);
             }
 
 
@@ -891,24 +2310,28 @@ int zkFrame::internal_handle_zk_service_event(int type, const char* service_path
             if (iter != sub_services_->end()) {
                 log_warning("delete service %s from subscribed list.", service_path);
                 sub_services_->erase(service_path);
+                publish_service(service_path);
+                service_synced(service_path);
             } else {
                 log_err("service %s not subscribed ??", service_path);
             }
         }
 
-        // for ZOO_CREATED_EVENT
-        client_->zk_exists(service_path, 1, NULL);
+        // for ZOO_CREATED_EVENT，持久watch在服务删除之后仍然有效
+        if (!persistent_watched(service_path))
+            client_->zk_exists(service_path, 1, NULL);
         return 0;
     } else if (type == ZOO_CHANGED_EVENT) {
         // 处理服务启动、禁用设置 == "1"
         std::string value;
         int code = 0;
-        if (client_->zk_get(service_path, value, 1, NULL) == 0) {
+        int watch = persistent_watched(service_path) ? 0 : 1;
+        if (client_->zk_get(service_path, value, watch, NULL) == 0) {
             std::lock_guard<std::mutex> lock(lock_);
             auto iter = sub_services_->find(service_path);
             if (iter != sub_services_->end()) {
-                iter->second.properties_["enable"] = value;
-                iter->second.enabled_ = (value == "1");
+                iter->second.set_value(value);
+                publish_service(service_path);
             } else {
                 log_err("service %s not subscribed, why we get this event???",
                         service_path);
@@ -921,7 +2344,7 @@ int zkFrame::internal_handle_zk_service_event(int type, const char* service_path
         return code;
     } else if (type == ZOO_CHILD_EVENT) {
         // recevied when add/remove new properties or node
-        return internal_subscribe_service(department, service);
+        return internal_diff_service_children(department, service);
     } else if (type == ZOO_SESSION_EVENT) {
         // Painic
         log_err("should not handle session_event in zkFrame here!");
@@ -935,6 +2358,150 @@ int zkFrame::internal_handle_zk_service_event(int type, const char* service_path
     return -1;
 }
 
+// 服务子节点列表变更的时候，和本地缓存的nodes_以及属性比较，只获取新增的节点和属性，
+// 删除已经不存在的节点和属性，处理的代价和变更的规模成正比
+int zkFrame::internal_diff_service_children(const std::string& department, const std::string& service) {
+
+    std::string service_path = zkPath::make_path(department, service);
+
+    bool with_nodes = false;
+    std::set<std::string> cached_nodes;
+    std::set<std::string> cached_properties;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto iter = sub_services_->find(service_path);
+        if (iter == sub_services_->end()) {
+            log_warning("service %s not cached, do full subscribe.", service_path.c_str());
+            return internal_subscribe_service(department, service);
+        }
+
+        with_nodes = iter->second.with_nodes_;
+        for (auto node = iter->second.nodes_.begin(); node != iter->second.nodes_.end(); ++node)
+            cached_nodes.insert(node->first);
+        for (auto property = iter->second.properties_.begin(); property != iter->second.properties_.end(); ++property)
+            cached_properties.insert(property->first);
+    }
+
+    int watch = persistent_watched(service_path) ? 0 : 1;
+
+    std::vector<std::string> children{};
+    struct Stat service_stat {};
+    if (client_->zk_get_children(service_path.c_str(), watch, children, &service_stat) != 0) {
+        log_err("get service children node failed %s", service_path.c_str());
+        return -1;
+    }
+
+    // 有读取失败的时候不更新服务目录的cversion，下次周期检查的时候重新比较
+    bool complete = true;
+    std::vector<std::string> added_nodes{};
+    std::map<std::string, std::string> added_properties{};
+    std::map<std::string, ZnodeVersion> added_versions{};
+    std::set<std::string> current_nodes;
+    std::set<std::string> current_properties;
+
+    for (size_t i = 0; i < children.size(); ++i) {
+
+        std::string sub_node = service_path + "/" + children[i];
+        PathType tp = zkPath::guess_path_type(sub_node);
+        if (tp == PathType::kServiceProperty) {
+            current_properties.insert(children[i]);
+            if (cached_properties.find(children[i]) != cached_properties.end())
+                continue;
+
+            std::string value;
+            struct Stat stat {};
+            if (client_->zk_get(sub_node.c_str(), value, watch, &stat) != 0) {
+                log_err("get service_property failed: %s", sub_node.c_str());
+                complete = false;
+                continue;
+            }
+            added_properties[children[i]] = value;
+            added_versions[sub_node].mzxid_ = stat.mzxid;
+            added_versions[sub_node].version_ = stat.version;
+        } else if (tp == PathType::kNode) {
+            if (!with_nodes)
+                continue;
+
+            current_nodes.insert(children[i]);
+            if (cached_nodes.find(children[i]) == cached_nodes.end())
+                added_nodes.push_back(sub_node);
+        } else {
+            log_err("unhandled service sub path: %s", sub_node.c_str());
+        }
+    }
+
+    // 缓存中有但是已经没有对应子节点的属性，可能是被删除的属性，也可能来自打包格式的服务目录值
+    std::set<std::string> removed_properties;
+    for (auto iter = cached_properties.begin(); iter != cached_properties.end(); ++iter) {
+        if (*iter != "enable" && current_properties.find(*iter) == current_properties.end())
+            removed_properties.insert(*iter);
+    }
+
+    if (!removed_properties.empty()) {
+        std::string value;
+        if (client_->zk_get(service_path.c_str(), value, watch, NULL) != 0) {
+            log_err("get service %s failed.", service_path.c_str());
+            return -1;
+        }
+
+        ServiceType packed(department, service);
+        packed.set_value(value);
+        for (auto iter = packed.properties_.begin(); iter != packed.properties_.end(); ++iter)
+            removed_properties.erase(iter->first);
+    }
+
+    ServiceType added(department, service);
+    if (!added_nodes.empty() &&
+        (fetch_nodes(service_path, added_nodes, added, watch) != 0 || added.nodes_.size() != added_nodes.size()))
+        complete = false;
+
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto iter = sub_services_->find(service_path);
+        if (iter == sub_services_->end()) {
+            log_err("service %s removed during update.", service_path.c_str());
+            return -1;
+        }
+
+        ServiceType& srv = iter->second;
+        for (auto node = cached_nodes.begin(); node != cached_nodes.end(); ++node) {
+            if (current_nodes.find(*node) == current_nodes.end()) {
+                log_info("node %s removed from service %s", node->c_str(), service_path.c_str());
+                srv.nodes_.erase(*node);
+                erase_versions(srv.versions_, service_path + "/" + *node);
+            }
+        }
+
+        for (auto node = added.nodes_.begin(); node != added.nodes_.end(); ++node) {
+            log_info("successfully detect and subscribe node %s", node->first.c_str());
+            srv.nodes_[node->first] = node->second;
+        }
+
+        for (auto version = added.versions_.begin(); version != added.versions_.end(); ++version)
+            srv.versions_[version->first] = version->second;
+
+        for (auto property = removed_properties.begin(); property != removed_properties.end(); ++property) {
+            srv.properties_.erase(*property);
+            srv.versions_.erase(service_path + "/" + *property);
+        }
+
+        for (auto property = added_properties.begin(); property != added_properties.end(); ++property)
+            srv.properties_[property->first] = property->second;
+
+        for (auto version = added_versions.begin(); version != added_versions.end(); ++version)
+            srv.versions_[version->first] = version->second;
+
+        // 只更新子节点的版本，服务目录的值没有重新读取
+        auto service_version = srv.versions_.find(service_path);
+        if (complete && service_version != srv.versions_.end())
+            service_version->second.cversion_ = service_stat.cversion;
+
+        publish_service(service_path);
+    }
+
+    return 0;
+}
+
 int zkFrame::internal_handle_zk_service_properties_event(int type, const char* service_property_path) {
 
     std::string department;
@@ -945,24 +2512,37 @@ int zkFrame::internal_handle_zk_service_properties_event(int type, const char* s
         return -1;
     }
 
-    if (type == ZOO_CREATED_EVENT) {
+    // 持久递归watch模式下没有ZOO_CHILD_EVENT，属性的增加删除直接通过本路径的事件处理
+    std::string service_path = zkPath::make_path(department, service);
+    bool persistent = persistent_watched(service_path);
+
+    if (type == ZOO_CREATED_EVENT && !persistent) {
         // Panic
         log_err("should not receive event %s for %s",
                 zkClient::zevent_str(type), service_property_path);
         return -1;
     } else if (type == ZOO_DELETED_EVENT) {
         // 服务目录内容的增加删除会得到 ZOO_CHILD_EVENT，在那边自动处理
+        if (!persistent)
+            return 0;
+
+        std::lock_guard<std::mutex> lock(lock_);
+        auto iter = sub_services_->find(service_path);
+        if (iter != sub_services_->end()) {
+            iter->second.properties_.erase(property);
+            publish_service(service_path);
+        }
         return 0;
-    } else if (type == ZOO_CHANGED_EVENT) {
+    } else if (type == ZOO_CHANGED_EVENT || type == ZOO_CREATED_EVENT) {
         // 普通的服务节点属性更新
         std::string value;
-        std::string service_path = zkPath::make_path(department, service);
         int code = 0;
-        if (client_->zk_get(service_property_path, value, 1, NULL) == 0) {
+        if (client_->zk_get(service_property_path, value, persistent ? 0 : 1, NULL) == 0) {
             std::lock_guard<std::mutex> lock(lock_);
             auto iter = sub_services_->find(service_path);
             if (iter != sub_services_->end()) {
                 iter->second.properties_[property] = value;
+                publish_service(service_path);
             } else {
                 log_err("service %s not subscribed, why we get this event???",
                         service_path.c_str());
@@ -1001,27 +2581,49 @@ int zkFrame::internal_handle_zk_node_event(int type, const char* node_path) {
         return -1;
     }
 
+    std::string service_path = zkPath::make_path(department, service);
+    bool persistent = persistent_watched(service_path);
+    if (persistent && !with_nodes(service_path))
+        return 0;
+
     if (type == ZOO_CREATED_EVENT) {
+        // 持久递归watch模式下节点的上线
+        if (persistent)
+            return internal_subscribe_node(node_path);
+
         // Panic
         log_err("should not receive event %s for %s",
                 zkClient::zevent_str(type), node_path);
         return -1;
     } else if (type == ZOO_DELETED_EVENT) {
         // service will recv ZOO_CHILD_EVENT and handle it
+        if (!persistent)
+            return 0;
+
+        std::lock_guard<std::mutex> lock(lock_);
+        auto iter = sub_services_->find(service_path);
+        if (iter != sub_services_->end()) {
+            iter->second.nodes_.erase(node);
+            publish_service(service_path);
+        }
         return 0;
     } else if (type == ZOO_CHANGED_EVENT) {
         // 节点启用禁用
         std::string value;
-        std::string service_path = zkPath::make_path(department, service);
         int code = 0;
-        if (client_->zk_get(node_path, value, 1, NULL) == 0) {
+        if (client_->zk_get(node_path, value, persistent ? 0 : 1, NULL) == 0) {
+
+            // 打包格式中的属性可能被删除，重新获取整个节点
+            if (zkPath::is_packed(value))
+                return internal_subscribe_node(node_path);
+
             std::lock_guard<std::mutex> lock(lock_);
             auto iter = sub_services_->find(service_path);
             if (iter != sub_services_->end()) {
                 auto node_p = iter->second.nodes_.find(node);
                 if (node_p != iter->second.nodes_.end()) {
-                    node_p->second.properties_["enable"] = value;
-                    node_p->second.enabled_ = (value == "1");
+                    node_p->second.set_value(value);
+                    publish_service(service_path);
                 } else {
                     log_err("node %s not found in sub_service, why we get this event?",
                             node.c_str());
@@ -1066,25 +2668,49 @@ int zkFrame::internal_handle_zk_node_properties_event(int type, const char* node
         return -1;
     }
 
-    if (type == ZOO_CREATED_EVENT) {
+    std::string service_path = zkPath::make_path(department, service);
+    bool persistent = persistent_watched(service_path);
+    if (persistent && !with_nodes(service_path))
+        return 0;
+
+    if (type == ZOO_CREATED_EVENT && !persistent) {
         // Panic
         log_err("should not receive event %s for %s",
                 zkClient::zevent_str(type), node_property_path);
         return -1;
     } else if (type == ZOO_DELETED_EVENT) {
         // 节点目录会得到 ZOO_CHILD_EVENT，在那边处理
+        if (!persistent)
+            return 0;
+
+        std::lock_guard<std::mutex> lock(lock_);
+        auto iter = sub_services_->find(service_path);
+        if (iter != sub_services_->end()) {
+            auto node_p = iter->second.nodes_.find(node);
+            if (node_p != iter->second.nodes_.end()) {
+                // 临时节点active的删除表示节点下线
+                if (property == "active")
+                    node_p->second.active_ = false;
+                node_p->second.properties_.erase(property);
+                publish_service(service_path);
+            }
+        }
         return 0;
-    } else if (type == ZOO_CHANGED_EVENT) {
+    } else if (type == ZOO_CHANGED_EVENT || type == ZOO_CREATED_EVENT) {
         std::string value;
-        std::string service_path = zkPath::make_path(department, service);
         int code = 0;
-        if (client_->zk_get(node_property_path, value, 1, NULL) == 0) {
+        bool missing = false;
+        if (client_->zk_get(node_property_path, value, persistent ? 0 : 1, NULL) == 0) {
             std::lock_guard<std::mutex> lock(lock_);
             auto iter = sub_services_->find(service_path);
             if (iter != sub_services_->end()) {
                 auto node_p = iter->second.nodes_.find(node);
                 if (node_p != iter->second.nodes_.end()) {
-                    node_p->second.properties_[property] = value;
+                    node_p->second.set_property(property, value);
+                    publish_service(service_path);
+                } else if (persistent) {
+                    // 节点的创建事件处理失败，重新获取整个节点
+                    missing = true;
                 } else {
                     log_err("node %s not found in sub_service, why we get this event?",
                             node.c_str());
@@ -1100,6 +2726,10 @@ int zkFrame::internal_handle_zk_node_properties_event(int type, const char* node
             log_err("retrieve value for path %s failed.", node_property_path);
             code = -1;
         }
+
+        if (missing)
+            return internal_subscribe_node(zkPath::make_path(department, service, node).c_str());
+
         return code;
     } else if (type == ZOO_CHILD_EVENT) {
         // property should not have child path
@@ -12,6 +12,8 @@
 #include <memory>
 #include <string>
 #include <map>
+#include <set>
+#include <atomic>
 
 #include <functional>
 
@@ -20,8 +22,11 @@
 
 #include "zkPath.h"
 #include "zkNode.h"
+#include "zkRoute.h"
 #include "zkClient.h"
 #include "zkRecipe.h"
+#include "zkEvent.h"
+#include "zkSnapshot.h"
 
 // 如果获取网络环境异常，zkFrame的构造就抛出该异常
 #include "ConstructException.h"
@@ -35,11 +40,24 @@
 // 只选择主节点，如果没有则失败返回
 #define kStrategyMaster     (0x1u<<1)
 
-// 下面三种选择算法是互斥的，按照该优先级处理
+// 下面几种选择算法是互斥的，按照该优先级处理
 #define kStrategyRandom     (0x1u<<5)
 #define kStrategyRoundRobin (0x1u<<6)
 #define kStrategyWP         (0x1u<<7)
 
+// 平滑加权轮询(nginx smooth weighted round-robin)，在最高优先级梯队中
+// 按照权重确定性的交错选择节点，优先级在kStrategyWP之上
+#define kStrategySWRR       (0x1u<<8)
+
+// 一致性哈希(ketama)，只对指定了key的选择生效，相同的key总是落到同一个节点上，
+// 节点增减的时候只有约1/N的key会迁移。订阅的时候指定该策略会预先构造哈希环，
+// 否则在第一次按照key选择的时候构造，之后的路由索引重建都会增量维护
+#define kStrategyConsistentHash (0x1u<<9)
+
+// 负载感知的两次随机选择(power of two choices)，随机取两个候选节点，选择
+// 延迟EWMA和在途请求数乘积较小的那一个，需要调用方通过begin_call/end_call反馈调用结果
+#define kStrategyP2C        (0x1u<<10)
+
 #define kStrategyDefault    (kStrategyIdc | kStrategyWP)
 
 
@@ -48,6 +66,22 @@
 
 namespace Clotho {
 
+// 批量订阅的服务描述
+struct ServiceSubscription {
+
+    ServiceSubscription(const std::string& department = "", const std::string& service = "",
+                        uint32_t strategy = kStrategyDefault, bool with_nodes = true) :
+        department_(department), service_(service),
+        strategy_(strategy), with_nodes_(with_nodes) { }
+
+    std::string department_;
+    std::string service_;
+    uint32_t    strategy_;
+    bool        with_nodes_;
+};
+
+struct BulkFetch;
+
 class zkFrame {
 
     FRIEND_TEST(zkFrameTest, ClientRegisterTest);
@@ -62,10 +96,18 @@ public:
     zkFrame(const zkFrame&) = delete;
     zkFrame& operator=(const zkFrame&) = delete;
 
-    bool init(const std::string& hostline);
+    // event_workers 为处理ZooKeeper事件的工作线程数目
+    // event_window_ms 为事件延迟处理的窗口，窗口内同一路径的重复事件会被合并
+    // snapshot_file 为订阅服务的本地快照文件，periodicly_care的时候写入，初始化的时候加载，
+    //               如果加载成功，ZooKeeper不可用的时候初始化也会成功，使用快照中的数据选择节点
+    // manifest_file 为订阅清单文件，初始化的时候批量订阅其中的全部服务，格式见load_manifest
+    bool init(const std::string& hostline, size_t event_workers = 4, uint32_t event_window_ms = 0,
+              const std::string& snapshot_file = "", const std::string& manifest_file = "");
 
     // 注册服务提供节点，override表示是否覆盖现有的属性值
-    int register_node(const NodeType& node, bool overwrite);
+    // packed表示使用打包格式，节点的全部属性存储在节点目录上，订阅者每个节点只需要常数次读取和watch
+    // 订阅端兼容两种格式，但是旧版本的订阅者会把打包格式的节点当作禁用，需要先升级全部订阅者
+    int register_node(const NodeType& node, bool overwrite, bool packed = false);
 
     // 解注册节点，服务禁用，为了让调用业务尽快感知，在服务下线的时候需要主动调用
     int revoke_node(const std::string& node_path);
@@ -74,6 +116,19 @@ public:
     // watch specific service
     int subscribe_service(const std::string& department, const std::string& service,
                           uint32_t strategy, bool with_nodes);
+    // 同时返回服务的句柄，后续可以直接使用句柄选择节点
+    int subscribe_service(const std::string& department, const std::string& service,
+                          uint32_t strategy, bool with_nodes, ServiceHandle& handle);
+
+    // 批量订阅，全部服务的请求同时发出，耗时取决于最慢的服务而不是全部服务之和
+    // timeout_ms 为0表示等待全部完成，超时的服务在后台继续订阅，在periodicly_care中完成登记
+    // 全部成功返回0，否则返回-1
+    int subscribe_services(const std::vector<ServiceSubscription>& subscriptions, uint32_t timeout_ms = 0);
+
+    // 订阅清单每行一个服务： department service [strategy] [with_nodes]
+    // strategy 支持十六进制(0x开头)，默认kStrategyDefault；with_nodes 为0或者1，默认1
+    // 空行以及#开头的行会被忽略
+    static int load_manifest(const std::string& file, std::vector<ServiceSubscription>& subscriptions);
 
     // 特定的服务选择算法实现
     // 根据subscribe时候的策略进行选择
@@ -82,6 +137,32 @@ public:
     // 手动自定义选择
     int pick_service_node(const std::string& department, const std::string& service,
                           uint32_t strategy, NodeType& node);
+    // 根据key进行一致性哈希选择，保持请求和节点的亲和性
+    int pick_service_node(const std::string& department, const std::string& service,
+                          const std::string& key, NodeType& node);
+
+    // 使用订阅返回的句柄选择节点，不需要构造解析路径，也不需要查找服务
+    int pick(const ServiceHandle& handle, NodeType& node);
+    int pick(const ServiceHandle& handle, uint32_t strategy, NodeType& node);
+    int pick(const ServiceHandle& handle, const std::string& key, NodeType& node);
+
+    // 只返回节点的地址信息，不拷贝NodeType，选择过程中没有堆内存分配
+    int pick(const ServiceHandle& handle, Endpoint& endpoint);
+    int pick(const ServiceHandle& handle, uint32_t strategy, Endpoint& endpoint);
+    int pick(const ServiceHandle& handle, const std::string& key, Endpoint& endpoint);
+
+    // 一次筛选选择最多count个互不相同的节点，用于扇出和对冲请求
+    // exclude为需要跳过的节点(ip:port)，比如重试的时候跳过已经失败的节点
+    int pick_service_nodes(const std::string& department, const std::string& service,
+                           uint32_t strategy, size_t count, std::vector<NodeType>& nodes,
+                           const std::set<std::string>& exclude = std::set<std::string>());
+
+    // 调用结果的反馈，用于负载感知的节点选择
+    // begin_call/end_call 成对调用，统计节点的在途请求数，end_call同时上报调用延迟
+    // report_call 只上报调用延迟，供不统计在途请求的调用方使用
+    int begin_call(const NodeType& node);
+    int end_call(const NodeType& node, uint32_t latency_us, bool success);
+    int report_call(const NodeType& node, uint32_t latency_us, bool success);
 
     // 注册制定路径的属性回调函数
     // 此处传入的路径只应该是服务节点，并且只有对应的服务被Watch了才有可能在属性变更的时候得到回调
@@ -122,18 +203,74 @@ public:
         return primary_node_addr_;
     }
 
+    // ZooKeeper的连接状态，非连接状态下仍然使用本地缓存的服务信息选择节点
+    ConnState connection_state() const {
+        return client_ ? client_->conn_state() : ConnState::kClosed;
+    }
+
+    bool connected() const {
+        return client_ && client_->connected();
+    }
+
+    // 使用的是本地快照中的数据，还没有和ZooKeeper同步
+    bool stale() const {
+        return stale_;
+    }
+
+    // 等待处理的ZooKeeper事件数目
+    size_t event_queue_depth() const {
+        return events_ ? events_->depth() : 0;
+    }
+
 private:
     //
     int substitute_node(const NodeType& node, std::vector<NodeType>& nodes);
-
-    int internal_subscribe_node(NodeType& node);
+    int multi_register(const VectorPair& persist_paths, const VectorPair& packed_paths,
+                       const std::vector<VectorPair>& ephemeral_paths, bool overwrite,
+                       std::vector<bool>& registered);
+    // 节点的临时路径，active和pid
+    static VectorPair ephemeral_node_paths(const std::string& node_path);
+    // 会话重建之后恢复节点的临时路径，仍被其他会话占用的节点放入restore_nodes_等待重试
+    int restore_nodes(const std::vector<std::string>& node_paths);
+    int merge_packed_properties(const std::string& node_path, std::map<std::string, std::string>& properties);
+
+    // versions不为空的时候替换其中节点及其属性的版本信息
+    int internal_subscribe_node(NodeType& node, int watch, std::map<std::string, ZnodeVersion>* versions = NULL);
 
     // rewatch的时候调用
     // overwrite 用于控制是否覆盖本地的weight, priority设置
     int internal_subscribe_service(const std::string& department, const std::string& service);
     int internal_subscribe_node(const char* node_path);
 
+    // 异步添加持久watch并发出服务的全部读取请求，结果由settle_bulk_watch确认
+    std::shared_ptr<BulkFetch> start_bulk_fetch(const std::string& service_path, const ServiceType& srv);
+    // 回收批量订阅中超时的请求，drain为true的时候有限时间等待全部完成并丢弃结果
+    void reap_bulk_fetches(bool drain);
+    // 快照加载的服务在和ZooKeeper同步之前，获取失败的时候继续使用缓存
+    bool serve_stale(const std::string& service_path, const ServiceType& srv);
+    // 服务当前发布的快照版本，没有发布过返回0
+    uint64_t route_version(const std::string& service_path);
+
+    // 获取服务的属性和节点信息填充到srv中，同时设置watch
+    // 并行的发出全部请求，在ZooKeeper回调线程中则退化为顺序请求
+    int fetch_service(const std::string& service_path, ServiceType& srv, int watch);
+    int fetch_service_sequential(const std::string& service_path, ServiceType& srv, int watch);
+    int fetch_nodes(const std::string& service_path, const std::vector<std::string>& node_paths,
+                    ServiceType& srv, int watch);
+    // 重新读取服务中指定的节点，替换缓存中的内容
+    int refresh_service_nodes(const std::string& service_path, const std::set<std::string>& node_paths);
+
+    // 持久递归watch模式，在服务目录上添加一个watch接收全部子路径的事件，读取的时候不需要再设置watch
+    // 需要编译时定义CLOTHO_PERSISTENT_WATCH并且服务端版本3.6以上，否则使用原来的一次性watch
+    int add_persistent_watch(const std::string& service_path);
+    bool persistent_watched(const std::string& service_path);
+    // 批量订阅中异步添加的持久watch，获取完成之后确认结果，失败则使用一次性watch重新获取
+    int settle_bulk_watch(BulkFetch& fetch);
+    // 持久watch会收到服务下全部路径的事件，不订阅节点的服务忽略节点事件
+    bool with_nodes(const std::string& service_path);
+
 private:
+    std::unique_ptr<zkEventQueue> events_;
     std::unique_ptr<zkClient> client_;
     std::unique_ptr<zkRecipe> recipe_;
 
@@ -158,9 +295,44 @@ private:
     // dept-srv 全路径作为键
     std::shared_ptr<MapServiceType> sub_services_;
 
+    // 恢复失败的已发布节点，periodicly_care中重试
+    std::set<std::string> restore_nodes_;
+
+    // 已经添加持久递归watch的服务
+    std::set<std::string> persistent_services_;
+    std::atomic<bool>     persistent_watch_supported_;
+
+    // 发布给pick_service_node使用的服务槽位，每个槽位中是只读的快照(包含预先构造的路由索引)，
+    // 通过std::atomic_load读取，不需要持有lock_。写入者在lock_保护下修改sub_services_之后，
+    // 调用publish_service构造新快照原子替换，只有新增服务的时候才需要替换整个槽位表
+    std::shared_ptr<const MapServiceSlot> sub_snapshots_;
+    uint64_t snapshot_version_;
+
+    std::string       snapshot_file_;
+    std::atomic<bool> stale_;
+    // 还没有从ZooKeeper重新获取过的快照服务，全部获取之后清除stale_，受lock_保护
+    std::set<std::string> stale_services_;
+
+    // 批量订阅超时之后仍然在途的请求
+    std::mutex                              bulk_lock_;
+    std::vector<std::shared_ptr<BulkFetch>> bulk_fetches_;
+
+    // 调用者需要持有lock_
+    void publish_service(const std::string& service_path);
+    // 服务已经从ZooKeeper完整获取，调用者需要持有lock_
+    void service_synced(const std::string& service_path);
+
+    ServiceRoutePtr find_route(const std::string& service_path);
+
+    NodeLoad* find_node_load(const NodeType& node, ServiceRoutePtr& route);
+
     int handle_zk_event(int type, int state, const char* path);
 
+    // 会话过期重建之后恢复临时节点和watch
+    int internal_session_renewed();
+
     int internal_handle_zk_service_event(int type, const char* service_path);
+    int internal_diff_service_children(const std::string& department, const std::string& service);
     int internal_handle_zk_service_properties_event(int type, const char* service_property_path);
     int internal_handle_zk_node_event(int type, const char* node_path);
     int internal_handle_zk_node_properties_event(int type, const char* node_property_path);
@@ -5,6 +5,7 @@
  *
  */
 
+#include <cstdlib>
 #include <ostream>
 
 #include "zkPath.h"
@@ -46,6 +47,47 @@ std::string NodeType::str() const {
 }
 
 
+void NodeType::set_property(const std::string& key, const std::string& value) {
+
+    // 特殊的属性值处理
+    if (key == "active") {
+        active_ = (value == "1" ? true : false);
+    } else if (key == "weight") {
+        int weight = ::atoi(value.c_str());
+        if (weight >= kWPMin && weight <= kWPMax)
+            weight_ = weight;
+    } else if (key == "priority") {
+        int priority = ::atoi(value.c_str());
+        if (priority >= kWPMin && priority <= kWPMax)
+            priority_ = priority;
+    } else if (key == "idc") {
+        if (value != "")
+            idc_ = value;
+    }
+
+    // all will be recorded in properties_
+    properties_[key] = value;
+}
+
+void NodeType::set_value(const std::string& value) {
+
+    std::string enable = value;
+
+    std::map<std::string, std::string> properties;
+    if (zkPath::unpack_properties(value, properties)) {
+        enable = "1";
+        for (auto iter = properties.begin(); iter != properties.end(); ++iter) {
+            if (iter->first == "enable")
+                enable = iter->second;
+            else
+                set_property(iter->first, iter->second);
+        }
+    }
+
+    properties_["enable"] = enable;
+    enabled_ = (enable == "1");
+}
+
 std::ostream& operator<<(std::ostream& os, const NodeType& node) {
     os << node.str() << std::endl;
     return os;
@@ -154,8 +196,10 @@ ServiceType::ServiceType(const std::string& department, const std::string& servi
     department_(department), service_(service),
     enabled_(true),
     pick_strategy_(kStrategyDefault),
+    version_(0),
     nodes_(),
-    properties_(properties) {
+    properties_(properties),
+    versions_() {
 }
 
 std::string ServiceType::str() const {
@@ -166,6 +210,7 @@ std::string ServiceType::str() const {
         << "fullpath: " << department_ << ", " << service_ << std::endl
         << "enabled: " << (enabled_ ? "on" : "off") << std::endl
         << "pick_strategy: " << pick_strategy_ << std::endl
+        << "version: " << version_ << std::endl
         << "nodes count: " << nodes_.size() << std::endl;
 
     ss << "properities: " << std::endl;
@@ -182,6 +227,25 @@ std::string ServiceType::str() const {
     return ss.str();
 }
 
+void ServiceType::set_value(const std::string& value) {
+
+    std::string enable = value;
+
+    std::map<std::string, std::string> properties;
+    if (zkPath::unpack_properties(value, properties)) {
+        enable = "1";
+        for (auto iter = properties.begin(); iter != properties.end(); ++iter) {
+            if (iter->first == "enable")
+                enable = iter->second;
+            else
+                properties_[iter->first] = iter->second;
+        }
+    }
+
+    properties_["enable"] = enable;
+    enabled_ = (enable == "1");
+}
+
 std::ostream& operator<<(std::ostream& os, const ServiceType& srv) {
     os << srv.str() << std::endl;
     return os;
@@ -35,6 +35,7 @@ typedef std::vector<std::pair<std::string, std::string>> VectorPair;
 // 2. idc    节点所在idc，如果节点选择算法包含kStrategyIdc，则会用到改值；
 // 3. priority & weight 节点配置的优先级和权重，范围1-100，默认为50；
 // 4. birth  临时节点，最新一次的发布日期时间
+// 5. max_inflight 节点允许的最大并发调用数，负载感知选择的时候会跳过饱和的节点，不设置表示不限制
 
 
 class NodeType {
@@ -47,7 +48,7 @@ public:
     NodeType() = default;
     ~NodeType() = default;
 
-    bool available() {
+    bool available() const {
         return active_ && enabled_;
     }
 
@@ -55,6 +56,14 @@ public:
     std::string str() const;
     bool prepare_path(VectorPair& paths);
 
+    // 记录属性值，保留属性同时更新对应的字段
+    void set_property(const std::string& key, const std::string& value);
+
+    // 节点目录的值，兼容两种存储格式：
+    // 1. "1"表示节点启用，属性分别存储在各自的子节点中
+    // 2. 打包格式，节点的全部属性序列化存储在节点目录上，其中enable为是否启用
+    void set_value(const std::string& value);
+
     static bool node_parse(const char* fp, std::string& d, std::string& s, std::string& n);
     static bool node_property_parse(const char* fp,
                                     std::string& d, std::string& s, std::string& n, std::string& p);
@@ -86,6 +95,18 @@ public:
 
 
 
+// 缓存的znode版本信息，周期性检查的时候对比服务端的Stat，只有变化了才重新读取
+// -1表示没有记录，cversion_只有读取过子节点列表的路径才会记录
+struct ZnodeVersion {
+
+    ZnodeVersion() :
+        mzxid_(-1), version_(-1), cversion_(-1) { }
+
+    int64_t mzxid_;
+    int32_t version_;
+    int32_t cversion_;
+};
+
 // ServiceType的properties中，我们主要提供的是服务治理相关的属性，不支持应用程序的配置参数
 // 目前框架使用的保留的属性键有：
 // 1. lock_xxx-xx   临时节点，服务级别的分布式互斥锁的实现，其值为节点名
@@ -100,12 +121,15 @@ public:
     ServiceType() = default;
     ~ServiceType() = default;
 
-    bool available() {
+    bool available() const {
         return enabled_;
     }
 
     std::string str() const;
 
+    // 服务目录的值，和NodeType::set_value一样兼容两种存储格式
+    void set_value(const std::string& value);
+
     static bool service_parse(const char* fp, std::string& d, std::string& s);
     static bool service_property_parse(const char* fp,
                                        std::string& d, std::string& s, std::string& p);
@@ -119,10 +143,15 @@ public:
     uint32_t    pick_strategy_;
     bool        with_nodes_; // 表示是否需要侦听nodes_节点信息，如果false则只关注properties
 
+    uint64_t    version_;    // 快照发布的版本号，每次发布单调递增
+
     std::map<std::string, NodeType> nodes_;
 
     std::map<std::string, std::string> properties_;
 
+    // 服务目录、服务属性、节点以及节点属性的版本信息，全路径作为键
+    std::map<std::string, ZnodeVersion> versions_;
+
     friend std::ostream& operator<<(std::ostream& os, const ServiceType& srv);
 };
 
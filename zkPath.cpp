@@ -203,5 +203,84 @@ bool zkPath::validate_node(const std::string& node_name, std::string& ip, uint16
 }
 
 
+static const std::string kPackedMagic = "#clotho:1\n";
+
+bool zkPath::is_packed(const std::string& value) {
+    return value.compare(0, kPackedMagic.size(), kPackedMagic) == 0;
+}
+
+static void escape_append(const std::string& str, std::string& result) {
+    for (size_t i = 0; i < str.size(); ++i) {
+        if (str[i] == '\\' || str[i] == '=') {
+            result.push_back('\\');
+            result.push_back(str[i]);
+        } else if (str[i] == '\n') {
+            result.append("\\n");
+        } else {
+            result.push_back(str[i]);
+        }
+    }
+}
+
+std::string zkPath::pack_properties(const std::map<std::string, std::string>& properties) {
+
+    std::string result = kPackedMagic;
+    for (auto iter = properties.begin(); iter != properties.end(); ++iter) {
+        escape_append(iter->first, result);
+        result.push_back('=');
+        escape_append(iter->second, result);
+        result.push_back('\n');
+    }
+
+    return result;
+}
+
+bool zkPath::unpack_properties(const std::string& value, std::map<std::string, std::string>& properties) {
+
+    if (!is_packed(value))
+        return false;
+
+    properties.clear();
+
+    std::string key;
+    std::string val;
+    std::string* current = &key;
+    bool has_sep = false;
+
+    for (size_t i = kPackedMagic.size(); i < value.size(); ++i) {
+
+        char c = value[i];
+        if (c == '\\') {
+            if (++i == value.size()) {
+                log_err("invalid packed properties, trailing escape.");
+                return false;
+            }
+            current->push_back(value[i] == 'n' ? '\n' : value[i]);
+        } else if (c == '=' && !has_sep) {
+            has_sep = true;
+            current = &val;
+        } else if (c == '\n') {
+            if (!has_sep || key.empty()) {
+                log_err("invalid packed properties line: %s", key.c_str());
+                return false;
+            }
+            properties[key] = val;
+            key.clear();
+            val.clear();
+            current = &key;
+            has_sep = false;
+        } else {
+            current->push_back(c);
+        }
+    }
+
+    if (!key.empty() || has_sep) {
+        log_err("invalid packed properties, incomplete line: %s", key.c_str());
+        return false;
+    }
+
+    return true;
+}
+
 } // end namespace Clotho
 
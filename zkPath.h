@@ -11,6 +11,7 @@
 #include <string>
 #include <cstring>
 #include <vector>
+#include <map>
 #include <limits>
 #include <sstream>
 
@@ -83,6 +84,12 @@ public:
     // ip:port node_name strict
     static bool validate_node(const std::string& node_name, std::string& ip, uint16_t& port);
 
+    // 打包的属性格式，全部属性序列化之后存储在一个目录节点上：
+    // 以 "#clotho:1\n" 开头，之后每行一个 key=value，其中的 '\\' '\n' '=' 使用'\\'转义
+    static bool is_packed(const std::string& value);
+    static std::string pack_properties(const std::map<std::string, std::string>& properties);
+    static bool unpack_properties(const std::string& value, std::map<std::string, std::string>& properties);
+
 };
 
 template<typename T>
@@ -0,0 +1,730 @@
+/*-
+ * Copyright (c) 2019 TAO Zhijiang<taozhijiang@gmail.com>
+ *
+ * Licensed under the BSD-3-Clause license, see LICENSE for full information.
+ *
+ */
+
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <arpa/inet.h>
+
+#include "zkFrame.h"
+#include "zkRoute.h"
+
+namespace Clotho {
+
+// 每个单位权重对应的虚拟节点数目，默认权重50的节点在环上有100个虚拟节点
+const static uint32_t kRingPointsPerWeight = 2;
+
+// 失败调用的最小惩罚延迟，100ms
+const static uint64_t kFailurePenaltyUs = 100 * 1000;
+
+// FNV-1a 加上 MurmurHash3 的fmix64，不依赖std::hash的实现，保证不同进程中
+// 相同的key得到相同的结果
+static inline uint64_t hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t hash_bytes(const std::string& str, uint64_t seed) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+    for (size_t i = 0; i < str.size(); ++i) {
+        h ^= static_cast<unsigned char>(str[i]);
+        h *= 0x100000001b3ULL;
+    }
+    return hash_mix(h);
+}
+
+static inline uint64_t splitmix64(uint64_t& x) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// xoshiro256**，每个线程独立的随机数发生器，替代内部带全局锁的::random()
+class ThreadRandom {
+
+public:
+    ThreadRandom() {
+        uint64_t seed = static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+        seed ^= std::hash<std::thread::id>()(std::this_thread::get_id());
+        seed ^= reinterpret_cast<uintptr_t>(this);
+        for (size_t i = 0; i < 4; ++i)
+            s_[i] = splitmix64(seed);
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(s_[1] * 5, 7) * 9;
+        uint64_t t = s_[1] << 17;
+
+        s_[2] ^= s_[0];
+        s_[3] ^= s_[1];
+        s_[1] ^= s_[2];
+        s_[0] ^= s_[3];
+        s_[2] ^= t;
+        s_[3] = rotl(s_[3], 45);
+
+        return result;
+    }
+
+private:
+    static inline uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t s_[4];
+};
+
+static inline uint64_t fast_random() {
+    static thread_local ThreadRandom rng;
+    return rng.next();
+}
+
+void NodeLoad::report_call(uint32_t latency_us, bool success) {
+
+    uint64_t sample = latency_us;
+    if (!success)
+        sample = std::max<uint64_t>(sample * 4, kFailurePenaltyUs);
+
+    uint64_t ewma = ewma_us_.load(std::memory_order_relaxed);
+    uint64_t next = 0;
+    do {
+        if (ewma == 0)
+            next = sample;
+        else
+            next = ewma - (ewma >> 3) + (sample >> 3);
+    } while (!ewma_us_.compare_exchange_weak(ewma, next, std::memory_order_relaxed));
+}
+
+void AliasTable::build(const std::vector<uint32_t>& weights) {
+
+    size_t count = weights.size();
+
+    prob_.assign(count, 0);
+    alias_.assign(count, 0);
+    total_ = 0;
+
+    for (size_t i = 0; i < count; ++i)
+        total_ += weights[i];
+
+    bool uniform = (total_ == 0);
+    if (uniform)
+        total_ = count;
+
+    // 放大count倍，使得平均每个槽位的概率恰好是total_
+    std::vector<uint64_t> scaled(count);
+    std::vector<uint32_t> small;
+    std::vector<uint32_t> large;
+
+    for (size_t i = 0; i < count; ++i) {
+        scaled[i] = (uniform ? 1 : weights[i]) * static_cast<uint64_t>(count);
+        if (scaled[i] < total_)
+            small.push_back(static_cast<uint32_t>(i));
+        else
+            large.push_back(static_cast<uint32_t>(i));
+    }
+
+    while (!small.empty() && !large.empty()) {
+        uint32_t s = small.back();
+        uint32_t l = large.back();
+        small.pop_back();
+        large.pop_back();
+
+        prob_[s]  = scaled[s];
+        alias_[s] = l;
+
+        scaled[l] = scaled[l] + scaled[s] - total_;
+        if (scaled[l] < total_)
+            small.push_back(l);
+        else
+            large.push_back(l);
+    }
+
+    // 剩下的槽位都是满概率的
+    for (size_t i = 0; i < large.size(); ++i) {
+        prob_[large[i]]  = total_;
+        alias_[large[i]] = large[i];
+    }
+    for (size_t i = 0; i < small.size(); ++i) {
+        prob_[small[i]]  = total_;
+        alias_[small[i]] = small[i];
+    }
+}
+
+
+static Endpoint make_endpoint(const NodeType& node) {
+
+    Endpoint endpoint;
+    endpoint.port_ = node.port_;
+
+    struct in_addr addr;
+    if (::inet_pton(AF_INET, node.host_.c_str(), &addr) == 1)
+        endpoint.addr_ = addr.s_addr;
+
+    endpoint.id_ = (static_cast<uint64_t>(ntohl(endpoint.addr_)) << 16) | endpoint.port_;
+
+    endpoint.sockaddr_.sin_family = AF_INET;
+    endpoint.sockaddr_.sin_port = htons(endpoint.port_);
+    endpoint.sockaddr_.sin_addr.s_addr = endpoint.addr_;
+
+    return endpoint;
+}
+
+ServiceRoute::ServiceRoute(ServiceType service, const std::string& idc, const ServiceRoute* previous) :
+    service_(std::move(service)),
+    nodes_(),
+    endpoints_(),
+    loads_(),
+    max_inflight_(),
+    all_loads_(),
+    all_(),
+    idc_buckets_(),
+    local_(NULL),
+    has_master_lock_(false),
+    master_(-1) {
+
+    // Step0. 选取所有可用节点，并按照IDC分桶
+    for (auto iter = service_.nodes_.begin(); iter != service_.nodes_.end(); ++iter) {
+
+        // 负载统计跨越版本保留
+        std::shared_ptr<NodeLoad> load;
+        if (previous) {
+            auto prev = previous->all_loads_.find(iter->first);
+            if (prev != previous->all_loads_.end())
+                load = prev->second;
+        }
+        if (!load)
+            load = std::make_shared<NodeLoad>();
+        all_loads_[iter->first] = load;
+
+        if (!iter->second.available())
+            continue;
+
+        int32_t max_inflight = 0;
+        auto property = iter->second.properties_.find("max_inflight");
+        if (property != iter->second.properties_.end())
+            max_inflight = std::max(::atoi(property->second.c_str()), 0);
+
+        uint32_t index = static_cast<uint32_t>(nodes_.size());
+        nodes_.push_back(&iter->second);
+        endpoints_.push_back(make_endpoint(iter->second));
+        loads_.push_back(load);
+        max_inflight_.push_back(max_inflight);
+        all_.index_.push_back(index);
+        idc_buckets_[iter->second.idc_].index_.push_back(index);
+    }
+
+    build_bucket(all_, previous ? &previous->all_ : NULL, previous);
+    for (auto iter = idc_buckets_.begin(); iter != idc_buckets_.end(); ++iter)
+        build_bucket(iter->second, previous_bucket(previous, iter->first), previous);
+
+    auto local = idc_buckets_.find(idc);
+    if (local != idc_buckets_.end())
+        local_ = &local->second;
+
+    // 订阅时指定了一致性哈希，或者上一个版本已经按照key选择过的桶，预先增量构造哈希环
+    bool consistent_hash = (service_.pick_strategy_ & kStrategyConsistentHash) != 0;
+    const RouteBucket* prev_all = previous ? &previous->all_ : NULL;
+    if (consistent_hash || (prev_all && prev_all->ring_ready_.load(std::memory_order_acquire))) {
+        build_ring(all_, prev_all, previous);
+        all_.ring_ready_ = true;
+    }
+
+    for (auto iter = idc_buckets_.begin(); iter != idc_buckets_.end(); ++iter) {
+        const RouteBucket* prev_bucket = previous_bucket(previous, iter->first);
+        if (consistent_hash || (prev_bucket && prev_bucket->ring_ready_.load(std::memory_order_acquire))) {
+            build_ring(iter->second, prev_bucket, previous);
+            iter->second.ring_ready_ = true;
+        }
+    }
+
+    // 设计原因，lock节点存储的是ip-pid的数据来标识锁的隶属的，我们无法保证存储节点信息，因为
+    // 非注册的节点也可以尝试获取分布式锁
+    // 这里根据每个节点properties的pid属性来进行尝试匹配
+    auto lock = service_.properties_.find("lock_master");
+    if (lock != service_.properties_.end()) {
+        has_master_lock_ = true;
+        for (size_t i = 0; i < nodes_.size(); ++i) {
+            auto pid = nodes_[i]->properties_.find("pid");
+            if (pid == nodes_[i]->properties_.end())
+                continue;
+
+            if (nodes_[i]->host_ + "-" + pid->second == lock->second) {
+                master_ = static_cast<int>(i);
+                break;
+            }
+        }
+    }
+}
+
+const RouteBucket* ServiceRoute::previous_bucket(const ServiceRoute* previous, const std::string& idc) {
+
+    if (!previous)
+        return NULL;
+
+    auto prev = previous->idc_buckets_.find(idc);
+    return prev != previous->idc_buckets_.end() ? &prev->second : NULL;
+}
+
+// 预先计算priority_数值最高的梯队及其权重采样表
+void ServiceRoute::build_bucket(RouteBucket& bucket, const RouteBucket* prev_bucket, const ServiceRoute* previous) {
+
+    uint16_t top_priority = 0;
+    for (size_t i = 0; i < bucket.index_.size(); ++i)
+        top_priority = std::max(top_priority, nodes_[bucket.index_[i]]->priority_);
+
+    for (size_t i = 0; i < bucket.index_.size(); ++i) {
+        const NodeType* node = nodes_[bucket.index_[i]];
+        if (node->priority_ != top_priority)
+            continue;
+
+        bucket.top_tier_.push_back(bucket.index_[i]);
+        bucket.weights_.push_back(node->weight_);
+    }
+
+    bucket.alias_.build(bucket.weights_);
+    bucket.swrr_current_.assign(bucket.top_tier_.size(), 0);
+
+    // 平滑加权轮询的current_weight按照节点名跨越版本保留，否则每次重建都会
+    // 打断交错的顺序，重建后的前几次选择集中在权重最大的节点上
+    if (prev_bucket && !bucket.top_tier_.empty()) {
+
+        std::map<std::string, int64_t> currents;
+        {
+            std::lock_guard<std::mutex> lock(prev_bucket->swrr_lock_);
+            for (size_t i = 0; i < prev_bucket->top_tier_.size(); ++i)
+                currents[previous->nodes_[prev_bucket->top_tier_[i]]->node_] = prev_bucket->swrr_current_[i];
+        }
+
+        int64_t sum = 0;
+        for (size_t i = 0; i < bucket.top_tier_.size(); ++i) {
+            auto iter = currents.find(nodes_[bucket.top_tier_[i]]->node_);
+            if (iter != currents.end())
+                bucket.swrr_current_[i] = iter->second;
+            sum += bucket.swrr_current_[i];
+        }
+
+        // 成员变化之后总和不再为0，平移回0附近，避免current_weight持续漂移
+        int64_t shift = sum / static_cast<int64_t>(bucket.top_tier_.size());
+        for (size_t i = 0; i < bucket.top_tier_.size(); ++i)
+            bucket.swrr_current_[i] -= shift;
+    }
+
+    // 随机的起始游标，避免所有客户端在索引重建之后都从同一个节点开始轮询
+    bucket.rr_cursor_ = static_cast<uint32_t>(fast_random());
+}
+
+// 增量构造哈希环：权重没有变化的节点直接复用上一个版本环上的虚拟节点，
+// 只为新增或者权重变更的节点计算虚拟节点，然后归并到一起
+void ServiceRoute::build_ring(const RouteBucket& bucket, const RouteBucket* prev_bucket, const ServiceRoute* previous) const {
+
+    std::map<std::string, uint32_t> names;
+    for (size_t i = 0; i < bucket.index_.size(); ++i)
+        names[nodes_[bucket.index_[i]]->node_] = bucket.index_[i];
+
+    std::vector<bool> reused(nodes_.size(), false);
+    std::vector<RingPoint> kept;
+
+    if (prev_bucket && prev_bucket->ring_ready_.load(std::memory_order_acquire)) {
+
+        std::vector<int64_t> remap(previous->nodes_.size(), -1);
+        for (size_t i = 0; i < prev_bucket->index_.size(); ++i) {
+            const NodeType* prev_node = previous->nodes_[prev_bucket->index_[i]];
+            auto iter = names.find(prev_node->node_);
+            if (iter != names.end() && nodes_[iter->second]->weight_ == prev_node->weight_) {
+                remap[prev_bucket->index_[i]] = iter->second;
+                reused[iter->second] = true;
+            }
+        }
+
+        kept.reserve(prev_bucket->ring_.size());
+        for (size_t i = 0; i < prev_bucket->ring_.size(); ++i) {
+            int64_t index = remap[prev_bucket->ring_[i].index_];
+            if (index >= 0) {
+                RingPoint point = { prev_bucket->ring_[i].hash_, static_cast<uint32_t>(index) };
+                kept.push_back(point);
+            }
+        }
+    }
+
+    std::vector<RingPoint> fresh;
+    for (size_t i = 0; i < bucket.index_.size(); ++i) {
+        uint32_t index = bucket.index_[i];
+        if (reused[index])
+            continue;
+
+        uint64_t node_hash = hash_bytes(nodes_[index]->node_, 0);
+        uint32_t count = std::max<uint32_t>(nodes_[index]->weight_, 1) * kRingPointsPerWeight;
+        for (uint32_t replica = 0; replica < count; ++replica) {
+            RingPoint point = { static_cast<uint32_t>(hash_mix(node_hash + replica)), index };
+            fresh.push_back(point);
+        }
+    }
+    std::sort(fresh.begin(), fresh.end());
+
+    bucket.ring_.resize(kept.size() + fresh.size());
+    std::merge(kept.begin(), kept.end(), fresh.begin(), fresh.end(), bucket.ring_.begin());
+}
+
+// 哈希环是只读索引中唯一延迟构造的部分，call_once保证只构造一次并且对其他线程可见
+const RouteBucket& ServiceRoute::ensure_ring(const RouteBucket& bucket) const {
+
+    if (!bucket.ring_ready_.load(std::memory_order_acquire)) {
+        std::call_once(bucket.ring_once_, [this, &bucket] {
+            build_ring(bucket, NULL, NULL);
+            bucket.ring_ready_.store(true, std::memory_order_release);
+        });
+    }
+
+    return bucket;
+}
+
+NodeLoad* ServiceRoute::find_load(const std::string& node) const {
+    auto iter = all_loads_.find(node);
+    if (iter == all_loads_.end())
+        return NULL;
+
+    return iter->second.get();
+}
+
+// 如果落点节点已经饱和，则沿着环顺时针溢出到下一个未饱和的节点
+int ServiceRoute::pick_ring(const RouteBucket& bucket, const std::string& key) const {
+
+    RingPoint target = { static_cast<uint32_t>(hash_bytes(key, 0)), 0 };
+    size_t start = std::lower_bound(bucket.ring_.begin(), bucket.ring_.end(), target) - bucket.ring_.begin();
+
+    for (size_t i = 0; i < bucket.ring_.size(); ++i) {
+        uint32_t index = bucket.ring_[(start + i) % bucket.ring_.size()].index_;
+        if (!saturated(index))
+            return index;
+    }
+
+    return -1;
+}
+
+// 随机选取两个不同的候选节点，跳过饱和的节点，选择负载评分较低的一个
+int ServiceRoute::pick_p2c(const RouteBucket& bucket) const {
+
+    size_t count = bucket.index_.size();
+    if (count == 1)
+        return saturated(bucket.index_[0]) ? -1 : bucket.index_[0];
+
+    size_t pos = fast_random() % count;
+    uint32_t first  = bucket.index_[pos];
+    uint32_t second = bucket.index_[(pos + 1 + fast_random() % (count - 1)) % count];
+
+    bool first_ok  = !saturated(first);
+    bool second_ok = !saturated(second);
+
+    if (first_ok && second_ok)
+        return loads_[first]->score() <= loads_[second]->score() ? first : second;
+    if (first_ok)
+        return first;
+    if (second_ok)
+        return second;
+
+    // 两个候选都饱和了，退化为在全部节点中查找负载最低的非饱和节点
+    int best = -1;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t index = bucket.index_[i];
+        if (saturated(index))
+            continue;
+        if (best < 0 || loads_[index]->score() < loads_[best]->score())
+            best = index;
+    }
+
+    return best;
+}
+
+// 每次选择的时候所有节点的current_weight增加自身权重，选出current_weight最大的节点，
+// 然后将其current_weight减去总权重，这样高权重节点的选择会均匀的分散在整个周期中
+// 饱和的节点以及不在allowed中的节点本轮不参与，current_weight保持不变(和nginx跳过故障节点的处理相同)
+int ServiceRoute::pick_swrr(const RouteBucket& bucket, const std::vector<uint32_t>* allowed) const {
+
+    std::lock_guard<std::mutex> lock(bucket.swrr_lock_);
+
+    int64_t total = 0;
+    int     best  = -1;
+    for (size_t i = 0; i < bucket.top_tier_.size(); ++i) {
+        if (saturated(bucket.top_tier_[i]))
+            continue;
+        if (allowed && std::find(allowed->begin(), allowed->end(), bucket.top_tier_[i]) == allowed->end())
+            continue;
+
+        bucket.swrr_current_[i] += bucket.weights_[i];
+        total += bucket.weights_[i];
+        if (best < 0 || bucket.swrr_current_[i] > bucket.swrr_current_[best])
+            best = static_cast<int>(i);
+    }
+
+    if (best < 0)
+        return -1;
+
+    bucket.swrr_current_[best] -= total;
+    return bucket.top_tier_[best];
+}
+
+// 从start开始顺序查找第一个非饱和的节点
+int ServiceRoute::next_unsaturated(const std::vector<uint32_t>& index, size_t start) const {
+
+    for (size_t i = 0; i < index.size(); ++i) {
+        uint32_t candidate = index[(start + i) % index.size()];
+        if (!saturated(candidate))
+            return candidate;
+    }
+
+    return -1;
+}
+
+int ServiceRoute::do_pick(uint32_t strategy, const std::string* key) const {
+
+    if (nodes_.empty()) {
+        log_err("not any available nodes for service /%s/%s with avaiable check.",
+                service_.department_.c_str(), service_.service_.c_str());
+        return -1;
+    }
+
+    // Step1. 如果有kStragetyMaster，则选择Master节点；失败就返回
+    if (strategy & kStrategyMaster) {
+        if (!has_master_lock_) {
+            log_err("lock_master not found for service /%s/%s",
+                    service_.department_.c_str(), service_.service_.c_str());
+            return -1;
+        }
+
+        if (master_ < 0) {
+            log_err("available master node %s not found",
+                    service_.properties_.find("lock_master")->second.c_str());
+            return -1;
+        }
+
+        return master_;
+    }
+
+    // Step2. 根据IDC进行候选解点的筛选
+    const RouteBucket* bucket = &all_;
+    if (strategy & kStrategyIdc) {
+        if (local_ == NULL) {
+            // 如果IDC筛选后可用节点为空，则取消IDC筛选条件
+            log_warning("filtered by kStrategyIdc remains empty nodes, reset IDC strict.");
+        } else if (local_->index_.size() == 1 && !saturated(local_->index_[0])) {
+            // 如果只得到一个可用节点，没有达到并发上限就直接返回这个节点
+            return local_->index_[0];
+        } else {
+            bucket = local_;
+        }
+    }
+
+    int index = pick_bucket(*bucket, strategy, key);
+    if (index >= 0 || bucket == &all_) {
+        if (index < 0)
+            log_err("all nodes of /%s/%s saturated.", service_.department_.c_str(), service_.service_.c_str());
+        return index;
+    }
+
+    // 本地IDC的节点都达到并发上限，取消IDC筛选，使用同样的策略在全部节点中选择
+    log_warning("local nodes of /%s/%s saturated, reset IDC strict.",
+                service_.department_.c_str(), service_.service_.c_str());
+    index = pick_bucket(all_, strategy, key);
+    if (index < 0)
+        log_err("all nodes of /%s/%s saturated.", service_.department_.c_str(), service_.service_.c_str());
+    return index;
+}
+
+// 所有策略都跳过达到并发上限的节点，桶内全部饱和返回-1
+int ServiceRoute::pick_bucket(const RouteBucket& bucket, uint32_t strategy, const std::string* key) const {
+
+    // Step3. 指定了key的一致性哈希
+    if (key && (strategy & kStrategyConsistentHash))
+        return pick_ring(ensure_ring(bucket), *key);
+
+    // Step4. 负载感知的两次随机选择
+    if (strategy & kStrategyP2C) {
+        return pick_p2c(bucket);
+    }
+
+    // Step5. 随机选择可用节点
+    if (strategy & kStrategyRandom) {
+        return next_unsaturated(bucket.index_, fast_random() % bucket.index_.size());
+    }
+
+    // Step6. Round-Robin方式轮询
+    if (strategy & kStrategyRoundRobin) {
+        uint32_t cursor = bucket.rr_cursor_.fetch_add(1, std::memory_order_relaxed);
+        return next_unsaturated(bucket.index_, cursor % bucket.index_.size());
+    }
+
+    // Step7. 平滑加权轮询
+    if (strategy & kStrategySWRR) {
+        int index = pick_swrr(bucket);
+        return index >= 0 ? index : next_unsaturated(bucket.index_, 0);
+    }
+
+    // Step8. 默认的，根据优先级和权重的方式筛选，最高优先级梯队都饱和的时候使用其余的节点
+    uint64_t rands = fast_random();
+    size_t pos = bucket.alias_.pick(static_cast<uint32_t>(rands), static_cast<uint32_t>(rands >> 32));
+    if (!saturated(bucket.top_tier_[pos]))
+        return bucket.top_tier_[pos];
+
+    int index = next_unsaturated(bucket.top_tier_, pos);
+    return index >= 0 ? index : next_unsaturated(bucket.index_, 0);
+}
+
+void ServiceRoute::filter_excluded(const RouteBucket& bucket, const std::set<std::string>& exclude,
+                                   std::vector<uint32_t>& candidates) const {
+
+    candidates.clear();
+    for (size_t i = 0; i < bucket.index_.size(); ++i) {
+        if (!saturated(bucket.index_[i]) && exclude.find(nodes_[bucket.index_[i]]->node_) == exclude.end())
+            candidates.push_back(bucket.index_[i]);
+    }
+}
+
+// 选择的语义和pick保持一致(包括跳过达到并发上限的节点)，区别在于：
+// kStrategyRandom, kStrategyRoundRobin 在候选节点中不放回的抽取或者连续的轮询
+// kStrategyP2C 按照负载评分由低到高选择非饱和节点
+// kStrategyWP 在最高优先级梯队中按照权重不放回抽样，不足的部分按照优先级从其余节点中补充
+// kStrategySWRR 只由平滑加权轮询决定第一个节点，其余的和kStrategyWP相同。轮询只在排除之后
+//               最高优先级的候选节点中进行，被排除的节点本轮不参与，current_weight保持不变，
+//               候选梯队不在桶的最高优先级中(比如被全部排除)的时候不推进轮询状态
+int ServiceRoute::pick_multi(uint32_t strategy, size_t count, const std::set<std::string>& exclude,
+                             std::vector<uint32_t>& result) const {
+
+    result.clear();
+
+    if (nodes_.empty()) {
+        log_err("not any available nodes for service /%s/%s with avaiable check.",
+                service_.department_.c_str(), service_.service_.c_str());
+        return -1;
+    }
+
+    if (count == 0)
+        return 0;
+
+    // Step1. Master节点只有一个
+    if (strategy & kStrategyMaster) {
+        int master = do_pick(kStrategyMaster, NULL);
+        if (master < 0)
+            return -1;
+
+        if (exclude.find(nodes_[master]->node_) != exclude.end()) {
+            log_err("master node %s is excluded.", nodes_[master]->node_.c_str());
+            return -1;
+        }
+
+        result.push_back(master);
+        return 0;
+    }
+
+    // Step2. 根据IDC进行候选解点的筛选，排除之后为空则取消IDC筛选条件
+    const RouteBucket* bucket = &all_;
+    std::vector<uint32_t> candidates;
+    if ((strategy & kStrategyIdc) && local_ != NULL) {
+        filter_excluded(*local_, exclude, candidates);
+        if (!candidates.empty())
+            bucket = local_;
+    }
+
+    if (candidates.empty())
+        filter_excluded(all_, exclude, candidates);
+
+    if (candidates.empty()) {
+        log_err("not any available nodes for service /%s/%s after exclude and saturated.",
+                service_.department_.c_str(), service_.service_.c_str());
+        return -1;
+    }
+
+    count = std::min(count, candidates.size());
+
+    // Step3. 负载感知，按照负载评分升序
+    if (strategy & kStrategyP2C) {
+        std::vector<std::pair<uint64_t, uint32_t>> scores;
+        for (size_t i = 0; i < candidates.size(); ++i)
+            scores.push_back(std::make_pair(loads_[candidates[i]]->score(), candidates[i]));
+
+        std::partial_sort(scores.begin(), scores.begin() + count, scores.end());
+        for (size_t i = 0; i < count; ++i)
+            result.push_back(scores[i].second);
+
+        return 0;
+    }
+
+    // Step4. 随机不放回抽取
+    if (strategy & kStrategyRandom) {
+        for (size_t i = 0; i < count; ++i) {
+            size_t j = i + fast_random() % (candidates.size() - i);
+            std::swap(candidates[i], candidates[j]);
+            result.push_back(candidates[i]);
+        }
+        return 0;
+    }
+
+    // Step5. Round-Robin方式连续轮询
+    if (strategy & kStrategyRoundRobin) {
+        uint32_t cursor = bucket->rr_cursor_.fetch_add(static_cast<uint32_t>(count), std::memory_order_relaxed);
+        for (size_t i = 0; i < count; ++i)
+            result.push_back(candidates[(cursor + i) % candidates.size()]);
+        return 0;
+    }
+
+    // Step6. 根据优先级和权重的方式筛选
+    uint16_t top_priority = 0;
+    for (size_t i = 0; i < candidates.size(); ++i)
+        top_priority = std::max(top_priority, nodes_[candidates[i]]->priority_);
+
+    std::vector<uint32_t> top_tier;
+    std::vector<uint32_t> rest;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        if (nodes_[candidates[i]]->priority_ == top_priority)
+            top_tier.push_back(candidates[i]);
+        else
+            rest.push_back(candidates[i]);
+    }
+
+    if (strategy & kStrategySWRR) {
+        int first = pick_swrr(*bucket, &top_tier);
+        if (first >= 0) {
+            result.push_back(first);
+            top_tier.erase(std::find(top_tier.begin(), top_tier.end(), static_cast<uint32_t>(first)));
+        }
+    }
+
+    // Efraimidis-Spirakis 加权不放回抽样，key = -ln(u) / weight，取key最小的若干个
+    std::vector<std::pair<double, uint32_t>> keys;
+    for (size_t i = 0; i < top_tier.size(); ++i) {
+        double u = (static_cast<double>(fast_random() >> 11) + 1.0) / 9007199254740993.0;
+        double weight = std::max<uint16_t>(nodes_[top_tier[i]]->weight_, 1);
+        keys.push_back(std::make_pair(-std::log(u) / weight, top_tier[i]));
+    }
+    std::sort(keys.begin(), keys.end());
+    for (size_t i = 0; i < keys.size() && result.size() < count; ++i)
+        result.push_back(keys[i].second);
+
+    // 最高优先级梯队不足的时候，按照优先级从高到低补充，相同优先级的随机排列
+    if (result.size() < count) {
+        for (size_t i = rest.size(); i > 1; --i)
+            std::swap(rest[i - 1], rest[fast_random() % i]);
+
+        std::stable_sort(rest.begin(), rest.end(),
+                         [this](uint32_t n1, uint32_t n2) {
+                             return nodes_[n1]->priority_ > nodes_[n2]->priority_;
+                         });
+
+        for (size_t i = 0; i < rest.size() && result.size() < count; ++i)
+            result.push_back(rest[i]);
+    }
+
+    return 0;
+}
+
+} // Clotho
@@ -0,0 +1,283 @@
+/*-
+ * Copyright (c) 2019 TAO Zhijiang<taozhijiang@gmail.com>
+ *
+ * Licensed under the BSD-3-Clause license, see LICENSE for full information.
+ *
+ */
+
+#ifndef __CLOTHO_ROUTE_H__
+#define __CLOTHO_ROUTE_H__
+
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include <netinet/in.h>
+
+#include "zkNode.h"
+
+// 服务的路由索引，在服务快照发布的时候一次性构造，之后只读
+// 节点的筛选、排序工作都在构造的时候完成，选择节点只需要常数或者对数时间的查找
+
+namespace Clotho {
+
+// Vose Alias Method 加权随机采样，构造O(n)，采样O(1)
+// 全部使用整数运算，随机数到区间的映射使用乘法移位而不是取模，
+// 每个(槽位, 阈值)的概率偏差不超过 n/2^32，不存在取模偏差
+class AliasTable {
+
+public:
+    AliasTable() :
+        prob_(), alias_(), total_(0) { }
+
+    // 权重全为0的时候按照等概率处理
+    void build(const std::vector<uint32_t>& weights);
+
+    // 返回被选中元素在weights中的下标，r1 r2 为两个独立的32位随机数
+    // 权重之和不超过2^32，乘积不会溢出
+    size_t pick(uint32_t r1, uint32_t r2) const {
+        size_t index = static_cast<size_t>((static_cast<uint64_t>(r1) * prob_.size()) >> 32);
+        return ((static_cast<uint64_t>(r2) * total_) >> 32) < prob_[index] ? index : alias_[index];
+    }
+
+    size_t size() const {
+        return prob_.size();
+    }
+
+private:
+    std::vector<uint64_t> prob_;    // 以total_为分母的留存概率
+    std::vector<uint32_t> alias_;
+    uint64_t              total_;
+};
+
+// 节点的实时负载统计，由调用方的反馈驱动，在路由索引重建的时候按照节点名保留
+class NodeLoad {
+
+public:
+    NodeLoad() :
+        inflight_(0), ewma_us_(0) { }
+
+    void begin_call() {
+        inflight_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void end_call() {
+        inflight_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // 延迟的指数加权移动平均，衰减系数1/8，失败的调用按照惩罚延迟计算
+    void report_call(uint32_t latency_us, bool success);
+
+    int32_t inflight() const {
+        int32_t inflight = inflight_.load(std::memory_order_relaxed);
+        return inflight > 0 ? inflight : 0;
+    }
+
+    // 负载评分，越小越优先
+    uint64_t score() const {
+        return (ewma_us_.load(std::memory_order_relaxed) + 1) * (inflight() + 1);
+    }
+
+private:
+    std::atomic<int32_t>  inflight_;
+    std::atomic<uint64_t> ewma_us_;
+};
+
+// 一致性哈希环上的虚拟节点
+struct RingPoint {
+    uint32_t hash_;
+    uint32_t index_;    // ServiceRoute::nodes_的下标
+
+    bool operator<(const RingPoint& other) const {
+        return hash_ < other.hash_;
+    }
+};
+
+// 选择节点的紧凑结果，地址信息在路由索引构造的时候预先解析好，拷贝不涉及堆内存分配
+// node_通过别名构造共享整个路由索引的引用计数，需要节点属性的调用方可以直接访问
+struct Endpoint {
+
+    Endpoint() :
+        addr_(0), port_(0), id_(0), sockaddr_(), node_() { }
+
+    uint32_t    addr_;  // IPv4地址，网络字节序，解析失败为0
+    uint16_t    port_;
+    uint64_t    id_;    // 稳定的节点标识，addr_ << 16 | port_
+
+    struct sockaddr_in sockaddr_;
+
+    std::shared_ptr<const NodeType> node_;
+};
+
+// 同一个IDC(或者全部IDC)的可用节点集合，其中的值都是ServiceRoute::nodes_的下标
+struct RouteBucket {
+
+    RouteBucket() :
+        index_(), top_tier_(), weights_(), alias_(),
+        ring_(), ring_once_(), ring_ready_(false),
+        rr_cursor_(0),
+        swrr_lock_(), swrr_current_() { }
+
+    std::vector<uint32_t> index_;
+
+    // priority_数值最高的节点梯队，以及按照weight_构造的采样表
+    std::vector<uint32_t> top_tier_;
+    std::vector<uint32_t> weights_;
+    AliasTable            alias_;
+
+    // 桶内全部可用节点的一致性哈希环，按照hash_排序
+    // 没有预先构造的时候在第一次按照key选择时构造，ring_ready_之后不再修改
+    mutable std::vector<RingPoint> ring_;
+    mutable std::once_flag         ring_once_;
+    mutable std::atomic<bool>      ring_ready_;
+
+    // 下面是路由索引中仅有的会被修改的状态
+    // Round-Robin的游标，每个服务每个桶独立
+    mutable std::atomic<uint32_t> rr_cursor_;
+
+    // 平滑加权轮询的current_weight
+    mutable std::mutex            swrr_lock_;
+    mutable std::vector<int64_t>  swrr_current_;
+};
+
+class ServiceRoute {
+
+public:
+    // previous为该服务上一个版本的路由索引，用于增量的构造一致性哈希环
+    ServiceRoute(ServiceType service, const std::string& idc, const ServiceRoute* previous = NULL);
+    ~ServiceRoute() = default;
+
+    // 内部保存了指向service_中节点的指针，禁止拷贝
+    ServiceRoute(const ServiceRoute&) = delete;
+    ServiceRoute& operator=(const ServiceRoute&) = delete;
+
+    const ServiceType& service() const {
+        return service_;
+    }
+
+    const NodeType& node(size_t index) const {
+        return *nodes_[index];
+    }
+
+    size_t size() const {
+        return nodes_.size();
+    }
+
+    // 预先解析好的地址信息，不包含node_
+    const Endpoint& endpoint(size_t index) const {
+        return endpoints_[index];
+    }
+
+    NodeLoad* load(size_t index) const {
+        return loads_[index].get();
+    }
+
+    // 按照节点名查找负载统计，包括当前不可用的节点，找不到返回NULL
+    NodeLoad* find_load(const std::string& node) const;
+
+    // 根据策略选择节点，返回节点在nodes_中的下标，失败返回-1
+    // 节点的并发上限(max_inflight属性)对Master之外的全部策略生效：跳过达到上限的节点，
+    // 本地IDC的节点都达到上限时取消IDC筛选，使用同样的策略在全部节点中选择
+    int pick(uint32_t strategy) const {
+        return do_pick(strategy, NULL);
+    }
+
+    int pick(uint32_t strategy, const std::string& key) const {
+        return do_pick(strategy, &key);
+    }
+
+    // 一次筛选最多选择count个互不相同的节点，exclude中的节点名不会被选中
+    int pick_multi(uint32_t strategy, size_t count, const std::set<std::string>& exclude,
+                   std::vector<uint32_t>& result) const;
+
+private:
+    int do_pick(uint32_t strategy, const std::string* key) const;
+    int pick_bucket(const RouteBucket& bucket, uint32_t strategy, const std::string* key) const;
+
+    void filter_excluded(const RouteBucket& bucket, const std::set<std::string>& exclude,
+                         std::vector<uint32_t>& candidates) const;
+
+    void build_bucket(RouteBucket& bucket, const RouteBucket* prev_bucket, const ServiceRoute* previous);
+    void build_ring(const RouteBucket& bucket, const RouteBucket* prev_bucket, const ServiceRoute* previous) const;
+    const RouteBucket& ensure_ring(const RouteBucket& bucket) const;
+
+    // 上一个版本中同一个IDC的桶，没有则返回NULL
+    static const RouteBucket* previous_bucket(const ServiceRoute* previous, const std::string& idc);
+
+    int pick_swrr(const RouteBucket& bucket, const std::vector<uint32_t>* allowed = NULL) const;
+    int next_unsaturated(const std::vector<uint32_t>& index, size_t start) const;
+    int pick_ring(const RouteBucket& bucket, const std::string& key) const;
+    int pick_p2c(const RouteBucket& bucket) const;
+
+    bool saturated(uint32_t index) const {
+        return max_inflight_[index] > 0 && loads_[index]->inflight() >= max_inflight_[index];
+    }
+
+    const ServiceType service_;
+
+    // 全部的可用节点
+    std::vector<const NodeType*> nodes_;
+    std::vector<Endpoint>        endpoints_;
+
+    // 和nodes_一一对应的负载统计以及并发上限(0表示不限制)
+    std::vector<std::shared_ptr<NodeLoad>> loads_;
+    std::vector<int32_t>                   max_inflight_;
+
+    // 服务下全部节点(包括不可用节点)的负载统计
+    std::map<std::string, std::shared_ptr<NodeLoad>> all_loads_;
+
+    RouteBucket all_;
+    std::map<std::string, RouteBucket> idc_buckets_;
+    const RouteBucket* local_;  // 本地IDC对应的桶，没有可用节点则为NULL
+
+    bool has_master_lock_;
+    int  master_;               // lock_master持有者在nodes_中的下标
+};
+
+typedef std::shared_ptr<const ServiceRoute>    ServiceRoutePtr;
+
+class zkFrame;
+
+// 订阅服务的槽位，服务每次发布都原子替换其中的路由索引
+// 槽位在服务第一次订阅之后就一直存在，所以其句柄可以被调用方长期持有
+class ServiceSlot {
+
+    friend class zkFrame;
+
+public:
+    explicit ServiceSlot(const std::string& service_path) :
+        service_path_(service_path), route_() { }
+
+    ~ServiceSlot() = default;
+
+    ServiceSlot(const ServiceSlot&) = delete;
+    ServiceSlot& operator=(const ServiceSlot&) = delete;
+
+    const std::string& service_path() const {
+        return service_path_;
+    }
+
+    // 服务被删除的时候返回空
+    ServiceRoutePtr route() const {
+        return std::atomic_load(&route_);
+    }
+
+private:
+    void set_route(const ServiceRoutePtr& route) {
+        std::atomic_store(&route_, route);
+    }
+
+    const std::string service_path_;
+    ServiceRoutePtr   route_;
+};
+
+typedef std::shared_ptr<ServiceSlot>            ServiceHandle;
+typedef std::map<std::string, ServiceHandle>    MapServiceSlot;
+
+} // Clotho
+
+#endif // __CLOTHO_ROUTE_H__
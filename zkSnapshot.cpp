@@ -0,0 +1,254 @@
+/*-
+ * Copyright (c) 2019 TAO Zhijiang<taozhijiang@gmail.com>
+ *
+ * Licensed under the BSD-3-Clause license, see LICENSE for full information.
+ *
+ */
+
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "zkPath.h"
+#include "zkSnapshot.h"
+
+namespace Clotho {
+
+struct SnapshotHeader {
+    uint32_t magic_;
+    uint32_t version_;
+    uint32_t count_;        // 服务数目
+    uint32_t reserved_;
+    uint64_t length_;       // 头部之后数据的长度
+    uint64_t checksum_;     // 头部之后数据的校验和
+};
+
+static void append_u32(uint32_t value, std::string& buff) {
+    buff.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void append_str(const std::string& value, std::string& buff) {
+    append_u32(static_cast<uint32_t>(value.size()), buff);
+    buff.append(value);
+}
+
+// 顺序读取mmap的内容，越界的时候返回false
+class SnapshotReader {
+
+public:
+    SnapshotReader(const char* data, size_t len) :
+        data_(data), len_(len), pos_(0) { }
+
+    bool read_u8(uint8_t& value) {
+        if (len_ - pos_ < sizeof(value))
+            return false;
+        value = static_cast<uint8_t>(data_[pos_++]);
+        return true;
+    }
+
+    bool read_u32(uint32_t& value) {
+        if (len_ - pos_ < sizeof(value))
+            return false;
+        ::memcpy(&value, data_ + pos_, sizeof(value));
+        pos_ += sizeof(value);
+        return true;
+    }
+
+    bool read_str(std::string& value) {
+        uint32_t size = 0;
+        if (!read_u32(size) || len_ - pos_ < size)
+            return false;
+        value.assign(data_ + pos_, size);
+        pos_ += size;
+        return true;
+    }
+
+    bool eof() const {
+        return pos_ == len_;
+    }
+
+private:
+    const char* data_;
+    size_t      len_;
+    size_t      pos_;
+};
+
+// FNV-1a 64
+uint64_t zkSnapshot::checksum(const char* data, size_t len) {
+
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= static_cast<uint8_t>(data[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+int zkSnapshot::dump(const std::string& file, const MapServiceType& services) {
+
+    if (file.empty())
+        return -1;
+
+    std::string body;
+    for (auto iter = services.begin(); iter != services.end(); ++iter) {
+
+        const ServiceType& srv = iter->second;
+        append_str(iter->first, body);
+        append_u32(srv.pick_strategy_, body);
+        body.push_back(srv.with_nodes_ ? 1 : 0);
+        append_str(zkPath::pack_properties(srv.properties_), body);
+
+        append_u32(static_cast<uint32_t>(srv.nodes_.size()), body);
+        for (auto node = srv.nodes_.begin(); node != srv.nodes_.end(); ++node) {
+            append_str(node->first, body);
+            append_str(zkPath::pack_properties(node->second.properties_), body);
+        }
+    }
+
+    SnapshotHeader header {};
+    header.magic_    = kMagic;
+    header.version_  = kVersion;
+    header.count_    = static_cast<uint32_t>(services.size());
+    header.length_   = body.size();
+    header.checksum_ = checksum(body.c_str(), body.size());
+
+    std::string tmp_file = file + ".tmp";
+    int fd = ::open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_err("open snapshot file %s failed: %s", tmp_file.c_str(), strerror(errno));
+        return -1;
+    }
+
+    std::string content(reinterpret_cast<const char*>(&header), sizeof(header));
+    content.append(body);
+
+    size_t written = 0;
+    while (written < content.size()) {
+        ssize_t ret = ::write(fd, content.c_str() + written, content.size() - written);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            log_err("write snapshot file %s failed: %s", tmp_file.c_str(), strerror(errno));
+            ::close(fd);
+            ::unlink(tmp_file.c_str());
+            return -1;
+        }
+        written += ret;
+    }
+
+    if (::fsync(fd) != 0 || ::close(fd) != 0) {
+        log_err("flush snapshot file %s failed: %s", tmp_file.c_str(), strerror(errno));
+        ::unlink(tmp_file.c_str());
+        return -1;
+    }
+
+    // rename是原子的，读取者看到的总是完整的文件
+    if (::rename(tmp_file.c_str(), file.c_str()) != 0) {
+        log_err("rename snapshot file to %s failed: %s", file.c_str(), strerror(errno));
+        ::unlink(tmp_file.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+int zkSnapshot::load(const std::string& file, MapServiceType& services) {
+
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        log_err("open snapshot file %s failed: %s", file.c_str(), strerror(errno));
+        return -1;
+    }
+
+    struct stat st {};
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+        log_err("invalid snapshot file %s", file.c_str());
+        ::close(fd);
+        return -1;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    void* addr = ::mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        log_err("mmap snapshot file %s failed: %s", file.c_str(), strerror(errno));
+        return -1;
+    }
+
+    const char* data = static_cast<const char*>(addr);
+    SnapshotHeader header {};
+    ::memcpy(&header, data, sizeof(header));
+
+    const char* body = data + sizeof(header);
+    size_t body_len = size - sizeof(header);
+
+    if (header.magic_ != kMagic || header.version_ != kVersion ||
+        header.length_ != body_len || header.checksum_ != checksum(body, body_len)) {
+        log_err("snapshot file %s corrupted, magic %x, version %u", file.c_str(), header.magic_, header.version_);
+        ::munmap(addr, size);
+        return -1;
+    }
+
+    MapServiceType loaded{};
+    SnapshotReader reader(body, body_len);
+    bool ok = true;
+
+    for (uint32_t i = 0; ok && i < header.count_; ++i) {
+
+        std::string service_path;
+        uint32_t strategy = 0;
+        uint8_t with_nodes = 0;
+        std::string value;
+        uint32_t node_count = 0;
+
+        std::string department;
+        std::string service;
+        if (!reader.read_str(service_path) || !reader.read_u32(strategy) ||
+            !reader.read_u8(with_nodes) || !reader.read_str(value) || !reader.read_u32(node_count) ||
+            !ServiceType::service_parse(service_path.c_str(), department, service)) {
+            ok = false;
+            break;
+        }
+
+        ServiceType srv(department, service);
+        srv.pick_strategy_ = strategy;
+        srv.with_nodes_ = (with_nodes != 0);
+        srv.set_value(value);
+
+        for (uint32_t j = 0; j < node_count; ++j) {
+
+            std::string node_p;
+            if (!reader.read_str(node_p) || !reader.read_str(value)) {
+                ok = false;
+                break;
+            }
+
+            NodeType node(department, service, node_p);
+            if (!zkPath::validate_node(node.node_, node.host_, node.port_)) {
+                log_err("validate nodename failed: %s", node.node_.c_str());
+                continue;
+            }
+
+            node.set_value(value);
+            srv.nodes_[node_p] = node;
+        }
+
+        loaded[service_path] = srv;
+    }
+
+    ::munmap(addr, size);
+
+    if (!ok || !reader.eof()) {
+        log_err("parse snapshot file %s failed.", file.c_str());
+        return -1;
+    }
+
+    services.swap(loaded);
+    return 0;
+}
+
+} // Clotho
@@ -0,0 +1,44 @@
+/*-
+ * Copyright (c) 2019 TAO Zhijiang<taozhijiang@gmail.com>
+ *
+ * Licensed under the BSD-3-Clause license, see LICENSE for full information.
+ *
+ */
+
+#ifndef __CLOTHO_SNAPSHOT_H__
+#define __CLOTHO_SNAPSHOT_H__
+
+#include <string>
+
+#include "zkNode.h"
+
+// 订阅服务缓存的本地快照文件，进程启动的时候加载，ZooKeeper不可用的时候也能够选择节点
+//
+// 文件格式(本机字节序，只在同一台机器上使用)：
+//   SnapshotHeader
+//   服务记录 * count_：
+//     str 服务路径, u32 选择策略, u8 with_nodes, str 打包的服务属性, u32 节点数目
+//     节点记录 * 节点数目： str 节点名, str 打包的节点属性
+// 其中 str 为 u32 长度加上内容，属性使用zkPath::pack_properties的打包格式
+//
+// 写入的时候先写临时文件再rename，读取使用mmap，校验失败整个文件都不使用
+
+namespace Clotho {
+
+class zkSnapshot {
+
+public:
+    static const uint32_t kMagic   = 0x54534c43;    // "CLST"
+    static const uint32_t kVersion = 1;
+
+    static int dump(const std::string& file, const MapServiceType& services);
+
+    // 加载的服务没有版本信息，之后的刷新会完整读取
+    static int load(const std::string& file, MapServiceType& services);
+
+    static uint64_t checksum(const char* data, size_t len);
+};
+
+} // Clotho
+
+#endif // __CLOTHO_SNAPSHOT_H__